@@ -0,0 +1,254 @@
+/**
+@file
+Ring-buffer recorder for Modbus TCP traffic.
+*/
+/*
+
+  ModbusCapture.cpp - Ring-buffer recorder for Modbus TCP traffic.
+
+  This file is part of ModbusTCP.
+
+  ModbusTCP is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  ModbusTCP is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ModbusTCP.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/* _____PROJECT INCLUDES_____________________________________________________ */
+#include "ModbusCapture.h"
+
+// functions to manipulate words
+#include "util/word.h"
+
+
+
+/* _____LOCAL FUNCTIONS______________________________________________________ */
+
+// pcap files are written little endian
+static void writeLE32(Print &out, uint32_t u32Value)
+{
+  out.write(lowByte(lowWord(u32Value)));
+  out.write(highByte(lowWord(u32Value)));
+  out.write(lowByte(highWord(u32Value)));
+  out.write(highByte(highWord(u32Value)));
+}
+
+static void writeLE16(Print &out, uint16_t u16Value)
+{
+  out.write(lowByte(u16Value));
+  out.write(highByte(u16Value));
+}
+
+
+
+/* _____PUBLIC FUNCTIONS_____________________________________________________ */
+
+/**
+Constructor.
+
+@param u8Storage buffer holding the records, e.g. a static array
+@param u16Size size of u8Storage in bytes
+@ingroup capture
+*/
+ModbusCapture::ModbusCapture(uint8_t *u8Storage, uint16_t u16Size)
+{
+  _u8Storage = u8Storage;
+  _u16Size = u16Size;
+  clear();
+}
+
+
+/**
+Record one ADU.
+
+Oldest records are dropped until the new one fits. An ADU larger than the
+whole buffer is not recorded.
+
+@param u8Flags ModbusCapture::CaptureRequest or ModbusCapture::CaptureResponse, optionally | ModbusCapture::CaptureIncomplete
+@param u8ADU ADU bytes
+@param u8Length ADU length
+@ingroup capture
+*/
+void ModbusCapture::record(uint8_t u8Flags, const uint8_t *u8ADU,
+  uint8_t u8Length)
+{
+  uint32_t u32Timestamp = micros();
+  uint16_t u16Needed = ku8RecordHeaderSize + u8Length;
+  uint8_t i;
+
+  if (u16Needed > _u16Size)
+  {
+    _u16DroppedCount++;
+    return;
+  }
+
+  while (_u16Size - _u16Used < u16Needed)
+  {
+    dropOldest();
+  }
+
+  put(lowByte(lowWord(u32Timestamp)));
+  put(highByte(lowWord(u32Timestamp)));
+  put(lowByte(highWord(u32Timestamp)));
+  put(highByte(highWord(u32Timestamp)));
+  put(u8Flags);
+  put(u8Length);
+  for (i = 0; i < u8Length; i++)
+  {
+    put(u8ADU[i]);
+  }
+  _u16RecordCount++;
+}
+
+
+/**
+Discard all records.
+
+@ingroup capture
+*/
+void ModbusCapture::clear()
+{
+  _u16Head = 0;
+  _u16Used = 0;
+  _u16RecordCount = 0;
+  _u16DroppedCount = 0;
+}
+
+
+/**
+Retrieve number of records held.
+
+@return number of records in the ring buffer
+@ingroup capture
+*/
+uint16_t ModbusCapture::getRecordCount()
+{
+  return _u16RecordCount;
+}
+
+
+/**
+Retrieve number of records lost.
+
+@return number of records dropped to make room, or too large to record
+@ingroup capture
+*/
+uint16_t ModbusCapture::getDroppedCount()
+{
+  return _u16DroppedCount;
+}
+
+
+/**
+Write all records, oldest first, in the compact record format.
+
+The output is the ring buffer content unwrapped, so a host tool can parse
+it with the record layout described at ModbusCapture.
+
+@param out destination, e.g. Serial or an open File
+@ingroup capture
+*/
+void ModbusCapture::dump(Print &out)
+{
+  uint16_t i;
+
+  for (i = 0; i < _u16Used; i++)
+  {
+    out.write(peek(i));
+  }
+}
+
+
+/**
+Write all records, oldest first, as a pcap file.
+
+Records use link type LINKTYPE_USER0 (147) with a one-byte pseudo header
+holding the record flags, followed by the Modbus TCP ADU. To decode them
+in Wireshark, add an entry for User 0 (DLT=147) under Preferences,
+Protocols, DLT_USER with payload protocol "mbtcp" and header size 1.
+
+Timestamps are micros() of the device, i.e. relative to its start-up.
+
+@param out destination, e.g. Serial or an open File
+@ingroup capture
+*/
+void ModbusCapture::dumpPcap(Print &out)
+{
+  uint16_t u16Offset = 0;
+  uint16_t i;
+
+  // global header: magic, version 2.4, GMT offset, accuracy, snaplen, link type
+  writeLE32(out, 0xA1B2C3D4);
+  writeLE16(out, 2);
+  writeLE16(out, 4);
+  writeLE32(out, 0);
+  writeLE32(out, 0);
+  writeLE32(out, 65535);
+  writeLE32(out, 147);
+
+  for (i = 0; i < _u16RecordCount; i++)
+  {
+    uint32_t u32Timestamp;
+    uint8_t u8Length = peek(u16Offset + 5);
+    uint8_t j;
+
+    u32Timestamp = peek(u16Offset + 3);
+    u32Timestamp = (u32Timestamp << 8) | peek(u16Offset + 2);
+    u32Timestamp = (u32Timestamp << 8) | peek(u16Offset + 1);
+    u32Timestamp = (u32Timestamp << 8) | peek(u16Offset);
+
+    writeLE32(out, u32Timestamp / 1000000UL);
+    writeLE32(out, u32Timestamp % 1000000UL);
+    writeLE32(out, u8Length + 1);
+    writeLE32(out, u8Length + 1);
+    out.write(peek(u16Offset + 4));
+    for (j = 0; j < u8Length; j++)
+    {
+      out.write(peek(u16Offset + ku8RecordHeaderSize + j));
+    }
+    u16Offset += ku8RecordHeaderSize + u8Length;
+  }
+}
+
+
+/* _____PRIVATE FUNCTIONS____________________________________________________ */
+/**
+Read byte at offset from the oldest record.
+*/
+uint8_t ModbusCapture::peek(uint16_t u16Offset)
+{
+  return _u8Storage[(uint16_t) ((_u16Head + u16Offset) % _u16Size)];
+}
+
+
+/**
+Append byte after the newest record.
+*/
+void ModbusCapture::put(uint8_t u8Value)
+{
+  _u8Storage[(uint16_t) ((_u16Head + _u16Used) % _u16Size)] = u8Value;
+  _u16Used++;
+}
+
+
+/**
+Drop the oldest record.
+*/
+void ModbusCapture::dropOldest()
+{
+  uint16_t u16Length = ku8RecordHeaderSize + peek(5);
+
+  _u16Head = (_u16Head + u16Length) % _u16Size;
+  _u16Used -= u16Length;
+  _u16RecordCount--;
+  _u16DroppedCount++;
+}
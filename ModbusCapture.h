@@ -0,0 +1,87 @@
+/**
+@file
+Ring-buffer recorder for Modbus TCP traffic.
+
+@defgroup capture ModbusCapture Traffic Recorder
+*/
+/*
+
+  ModbusCapture.h - Ring-buffer recorder for Modbus TCP traffic.
+
+  This file is part of ModbusTCP.
+
+  ModbusTCP is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  ModbusTCP is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ModbusTCP.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+
+#ifndef Modbus_Capture_h
+#define Modbus_Capture_h
+
+
+/* _____STANDARD INCLUDES____________________________________________________ */
+// include types & constants of Wiring core API
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "Arduino.h"
+#else
+#include "WProgram.h"
+#endif
+
+
+/* _____CLASS DEFINITIONS____________________________________________________ */
+/**
+Records timestamped request/response ADUs into a caller-supplied ring
+buffer, dropping the oldest records when full.
+
+Each record is stored as:
+  - timestamp, micros() at record time (4 bytes, little endian)
+  - flags, ModbusCapture::CaptureResponse / ModbusCapture::CaptureIncomplete (1 byte)
+  - ADU length (1 byte)
+  - ADU
+
+@ingroup capture
+*/
+class ModbusCapture
+{
+  public:
+
+    ModbusCapture(uint8_t *, uint16_t);
+
+    void     record(uint8_t, const uint8_t *, uint8_t);
+    void     clear();
+    uint16_t getRecordCount();
+    uint16_t getDroppedCount();
+    void     dump(Print &);
+    void     dumpPcap(Print &);
+
+    static const uint8_t CaptureRequest    = 0x00; ///< record is a request sent by the client
+    static const uint8_t CaptureResponse   = 0x01; ///< record is a response received from the server
+    static const uint8_t CaptureIncomplete = 0x02; ///< response ended early (timeout, protocol error)
+
+  private:
+
+    static const uint8_t ku8RecordHeaderSize = 6;  ///< timestamp, flags, length
+
+    uint8_t *_u8Storage;                           ///< ring buffer
+    uint16_t _u16Size;                             ///< size of ring buffer
+    uint16_t _u16Head;                             ///< offset of oldest record
+    uint16_t _u16Used;                             ///< bytes in use
+    uint16_t _u16RecordCount;                      ///< records in ring buffer
+    uint16_t _u16DroppedCount;                     ///< records dropped to make room
+
+    uint8_t  peek(uint16_t);
+    void     put(uint8_t);
+    void     dropOldest();
+};
+#endif
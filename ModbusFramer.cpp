@@ -0,0 +1,222 @@
+/**
+@file
+Incremental MBAP framer for Modbus TCP byte streams.
+*/
+/*
+
+  ModbusFramer.cpp - Incremental MBAP framer for Modbus TCP byte streams.
+
+  This file is part of ModbusTCP.
+
+  ModbusTCP is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  ModbusTCP is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ModbusTCP.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/* _____PROJECT INCLUDES_____________________________________________________ */
+#include "ModbusFramer.h"
+
+
+
+/* _____PUBLIC FUNCTIONS_____________________________________________________ */
+
+/**
+Constructor.
+
+@ingroup framer
+*/
+ModbusFramer::ModbusFramer()
+{
+  _u16ResyncCount = 0;
+  _u16TransactionID = 0;
+  _u8FrameLength = 0;
+  reset();
+}
+
+
+/**
+Forget the frame in progress.
+
+Call when the connection has been closed or re-opened.
+
+@ingroup framer
+*/
+void ModbusFramer::reset()
+{
+  _u8HeaderCount = 0;
+  _u16BodyCount = 0;
+  _u16BodyLength = 0;
+  _bStale = false;
+}
+
+
+/**
+Start waiting for the response to a new request.
+
+A frame already in progress belongs to an earlier request; it will be
+completed and reported as ModbusFramer::FrameStale.
+
+@param u16TransactionID transaction identifier of the request
+@ingroup framer
+*/
+void ModbusFramer::begin(uint16_t u16TransactionID)
+{
+  _u16TransactionID = u16TransactionID;
+  _bStale = (_u8HeaderCount != 0);
+}
+
+
+/**
+Accept responses up to a newer request, e.g. one sent while others are
+still outstanding.
+
+Unlike ModbusFramer::begin(), the frame in progress stays valid.
+
+@param u16TransactionID transaction identifier of the newest request
+@ingroup framer
+*/
+void ModbusFramer::expect(uint16_t u16TransactionID)
+{
+  _u16TransactionID = u16TransactionID;
+}
+
+
+/**
+Read available bytes of the frame in progress.
+
+Reads at most up to the end of the current frame. On completion the
+whole ADU (MBAP header, unit id, PDU) is in u8ADU and the framer is ready
+for the next frame.
+
+With bWholeBody, unit id and PDU are only read once all of them are 
+available, so u8ADU only needs to be valid during the call that completes 
+the frame; the header is kept by the framer in any case.
+
+@param client connection to read from
+@param u8ADU ADU buffer, at least ModbusFramer::ku8MaxFrameLength + 1 bytes; unit id and PDU are stored as they arrive
+@param bWholeBody true to leave unit id and PDU in the socket until they are complete
+@return ModbusFramer::FrameIncomplete, ModbusFramer::FrameComplete, ModbusFramer::FrameStale or ModbusFramer::FrameTooLong
+@ingroup framer
+*/
+uint8_t ModbusFramer::receive(Client &client, uint8_t *u8ADU, bool bWholeBody)
+{
+  int iAvailable;
+  int iRead;
+  uint8_t u8Status;
+
+  while ((iAvailable = client.available()) > 0)
+  {
+    if (!_u16BodyLength)
+    {
+      _u8Header[_u8HeaderCount++] = client.read();
+      if (_u8HeaderCount == ku8HeaderSize && !checkHeader())
+      {
+        // garbage; slide by one byte and look for a header again
+        memmove(_u8Header, _u8Header + 1, ku8HeaderSize - 1);
+        _u8HeaderCount--;
+        _u16ResyncCount++;
+      }
+      continue;
+    }
+
+    if (_u16BodyLength > ku8MaxFrameLength - ku8HeaderSize)
+    {
+      // valid, but does not fit the buffer; skip it byte by byte
+      client.read();
+      _u16BodyCount++;
+    }
+    else
+    {
+      // read the rest of the frame in one go, never beyond it
+      iRead = _u16BodyLength - _u16BodyCount;
+      if (iRead > iAvailable)
+      {
+        if (bWholeBody)
+        {
+          break;
+        }
+        iRead = iAvailable;
+      }
+      iRead = client.read(u8ADU + ku8HeaderSize + _u16BodyCount, iRead);
+      if (iRead <= 0)
+      {
+        break;
+      }
+      _u16BodyCount += iRead;
+    }
+
+    if (_u16BodyCount == _u16BodyLength)
+    {
+      memcpy(u8ADU, _u8Header, ku8HeaderSize);
+      if (_u16BodyLength > ku8MaxFrameLength - ku8HeaderSize)
+      {
+        _u8FrameLength = ku8HeaderSize;
+        u8Status = _bStale ? FrameStale : FrameTooLong;
+      }
+      else
+      {
+        _u8FrameLength = ku8HeaderSize + _u16BodyLength;
+        u8Status = _bStale ? FrameStale : FrameComplete;
+      }
+      reset();
+      return u8Status;
+    }
+  }
+  return FrameIncomplete;
+}
+
+
+/**
+Retrieve length of the last received frame.
+
+@return ADU length in bytes, including the MBAP header
+@ingroup framer
+*/
+uint8_t ModbusFramer::getFrameLength()
+{
+  return _u8FrameLength;
+}
+
+
+/**
+Retrieve number of bytes dropped while searching for a valid header.
+
+@return garbage byte count
+@ingroup framer
+*/
+uint16_t ModbusFramer::getResyncCount()
+{
+  return _u16ResyncCount;
+}
+
+
+/* _____PRIVATE FUNCTIONS____________________________________________________ */
+/**
+Validate the MBAP header and take the frame length from it.
+
+@return true if the header is plausible
+*/
+bool ModbusFramer::checkHeader()
+{
+  uint16_t u16Age = _u16TransactionID - word(_u8Header[0], _u8Header[1]);
+  uint16_t u16Length = word(_u8Header[4], _u8Header[5]);
+
+  // recent request, protocol id 0; unit id and function code at least
+  if (u16Age >= ku8TransactionWindow || _u8Header[2] || _u8Header[3] ||
+    u16Length < 2 || u16Length > ku16MaxADULength - ku8HeaderSize)
+  {
+    return false;
+  }
+  _u16BodyLength = u16Length;
+  return true;
+}
@@ -0,0 +1,102 @@
+/**
+@file
+Incremental MBAP framer for Modbus TCP byte streams.
+
+@defgroup framer ModbusFramer MBAP Stream Framer
+*/
+/*
+
+  ModbusFramer.h - Incremental MBAP framer for Modbus TCP byte streams.
+
+  This file is part of ModbusTCP.
+
+  ModbusTCP is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  ModbusTCP is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ModbusTCP.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+
+#ifndef Modbus_Framer_h
+#define Modbus_Framer_h
+
+
+/* _____STANDARD INCLUDES____________________________________________________ */
+// include types & constants of Wiring core API
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "Arduino.h"
+#else
+#include "WProgram.h"
+#endif
+
+#include "Client.h"
+
+
+/* _____CLASS DEFINITIONS____________________________________________________ */
+/**
+Splits a Modbus TCP byte stream into ADUs by the MBAP length field.
+
+Only the bytes of the frame in progress are read from the client; any
+following frame stays in the socket receive buffer for the next call,
+so frames may arrive split over or coalesced into TCP segments in any
+way. The state of a frame in progress is kept between transactions: a
+frame started before ModbusFramer::begin() is read to its end and
+reported as stale instead of being mistaken for the next response.
+
+A header with a protocol identifier other than 0, an impossible length or
+a transaction identifier that does not belong to one of the recent
+requests is treated as garbage; the framer drops its first byte and
+searches the following bytes for a valid header without closing the
+connection. A valid frame longer than the ADU buffer (the protocol
+allows up to ModbusFramer::ku16MaxADULength bytes) is read to its end
+and dropped, so the framer stays in step with the stream.
+
+@ingroup framer
+*/
+class ModbusFramer
+{
+  public:
+
+    ModbusFramer();
+
+    void     reset();
+    void     begin(uint16_t);
+    void     expect(uint16_t);
+    uint8_t  receive(Client &, uint8_t *, bool = false);
+    uint8_t  getFrameLength();
+    uint16_t getResyncCount();
+
+    static const uint8_t FrameIncomplete  = 0x00; ///< more bytes needed
+    static const uint8_t FrameComplete    = 0x01; ///< an ADU has been received
+    static const uint8_t FrameStale       = 0x02; ///< an ADU has been received, but it was started before begin()
+    static const uint8_t FrameTooLong     = 0x03; ///< an ADU too long for the buffer has been skipped; only its header is available
+
+    static const uint8_t ku8MaxFrameLength = 255; ///< largest ADU received into the 256 byte ADU buffer
+    static const uint16_t ku16MaxADULength = 260; ///< largest ADU the protocol allows
+    static const uint8_t ku8TransactionWindow = 16; ///< transaction ids accepted, counting back from the newest request
+
+  private:
+
+    static const uint8_t ku8HeaderSize = 6;       ///< transaction id, protocol id, length
+
+    uint8_t  _u8Header[ku8HeaderSize];            ///< MBAP header of the frame in progress
+    uint8_t  _u8HeaderCount;                      ///< header bytes received
+    uint16_t _u16BodyCount;                       ///< unit id/PDU bytes received
+    uint16_t _u16BodyLength;                      ///< unit id/PDU bytes expected, 0 until the header is valid
+    uint8_t  _u8FrameLength;                      ///< length of the last received ADU
+    bool     _bStale;                             ///< frame in progress was started before begin()
+    uint16_t _u16TransactionID;                   ///< id of the newest request
+    uint16_t _u16ResyncCount;                     ///< garbage bytes dropped
+
+    bool     checkHeader();
+};
+#endif
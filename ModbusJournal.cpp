@@ -0,0 +1,118 @@
+/**
+@file
+Change journal of modified register ranges, kept in a register window.
+*/
+/*
+
+  ModbusJournal.cpp - Change journal of modified register ranges, kept in a
+  register window.
+
+  This file is part of ModbusTCP.
+
+  ModbusTCP is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  ModbusTCP is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ModbusTCP.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/* _____PROJECT INCLUDES_____________________________________________________ */
+#include "ModbusJournal.h"
+
+
+
+/* _____PUBLIC FUNCTIONS_____________________________________________________ */
+
+/**
+Constructor.
+
+@param u16Window register window, ModbusJournal::windowSize(u8Entries) registers, e.g. part of the server's holding register array
+@param u8Entries number of entries the journal keeps
+@ingroup journal
+*/
+ModbusJournal::ModbusJournal(uint16_t *u16Window, uint8_t u8Entries)
+{
+  _u16Window = u16Window;
+  _u8Entries = u8Entries;
+  _u16Window[0] = 0;
+  clear();
+}
+
+
+/**
+Record a modified register range.
+
+Call after the registers have been written. Sequence numbers of
+consecutive entries are consecutive, so a client can tell whether
+entries it has not seen yet were overwritten. They wrap from 65535 to
+1, as 0 means the journal is empty.
+
+@param u16Address address of the first modified register
+@param u16Qty quantity of modified registers
+@ingroup journal
+*/
+void ModbusJournal::record(uint16_t u16Address, uint16_t u16Qty)
+{
+  uint16_t u16Sequence = _u16Window[0] + 1;
+  uint16_t *u16Entry;
+
+  if (!_u8Entries)
+  {
+    return;
+  }
+  if (!u16Sequence)
+  {
+    u16Sequence = 1;
+  }
+
+  u16Entry = _u16Window + 2 + 3 * _u8Next;
+  u16Entry[0] = u16Sequence;
+  u16Entry[1] = u16Address;
+  u16Entry[2] = u16Qty;
+  _u8Next = (_u8Next + 1) % _u8Entries;
+  if (_u16Window[1] < _u8Entries)
+  {
+    _u16Window[1]++;
+  }
+  _u16Window[0] = u16Sequence;
+}
+
+
+/**
+Discard all entries.
+
+The sequence number is kept, so clients see the journal as overrun
+rather than unchanged.
+
+@ingroup journal
+*/
+void ModbusJournal::clear()
+{
+  uint16_t i;
+
+  for (i = 1; i < windowSize(_u8Entries); i++)
+  {
+    _u16Window[i] = 0;
+  }
+  _u8Next = 0;
+}
+
+
+/**
+Retrieve sequence number of the newest entry.
+
+@return sequence number
+@ingroup journal
+*/
+uint16_t ModbusJournal::getSequence()
+{
+  return _u16Window[0];
+}
@@ -0,0 +1,104 @@
+/**
+@file
+Change journal of modified register ranges, kept in a register window.
+
+@defgroup journal ModbusJournal Register Change Journal
+*/
+/*
+
+  ModbusJournal.h - Change journal of modified register ranges, kept in a
+  register window.
+
+  This file is part of ModbusTCP.
+
+  ModbusTCP is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  ModbusTCP is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ModbusTCP.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+
+#ifndef Modbus_Journal_h
+#define Modbus_Journal_h
+
+
+/* _____STANDARD INCLUDES____________________________________________________ */
+// include types & constants of Wiring core API
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "Arduino.h"
+#else
+#include "WProgram.h"
+#endif
+
+
+/* _____CLASS DEFINITIONS____________________________________________________ */
+/**
+Sequence-numbered log of modified holding register ranges, for the
+server side of report-by-exception polling.
+
+The journal lives in a window of registers that the server exposes as
+holding registers, so any client can read it with function 0x03:
+  - register 0: sequence number of the newest entry (0 while empty,
+    never 0 afterwards)
+  - register 1: number of valid entries
+  - registers 2 + 3 * i: entry i as sequence number, start address, quantity
+
+Entries form a ring; the oldest one is overwritten when the journal is
+full. A client reads the whole register set once, then remembers the
+last sequence number it has seen and only re-reads the ranges of newer
+entries, see ModbusTCP::readChangedRegisters().
+
+@ingroup journal
+*/
+class ModbusJournal
+{
+  public:
+
+    ModbusJournal(uint16_t *, uint8_t);
+
+    void     record(uint16_t, uint16_t);
+    void     clear();
+    uint16_t getSequence();
+
+    /**
+    Size of a journal window.
+
+    @param u8Entries number of entries
+    @return window size in registers
+    */
+    static uint16_t windowSize(uint8_t u8Entries)
+    {
+      return 2 + 3 * (uint16_t)u8Entries;
+    }
+
+    /**
+    Number of entries recorded after a sequence number.
+
+    Sequence numbers skip 0 when they wrap, so this is one less than
+    the plain difference across a wrap.
+
+    @param u16From sequence number seen last; 0 if none
+    @param u16To sequence number of a later entry
+    @return number of entries from u16From (exclusive) to u16To (inclusive)
+    */
+    static uint16_t distance(uint16_t u16From, uint16_t u16To)
+    {
+      return u16To - u16From - (u16To < u16From);
+    }
+
+  private:
+
+    uint16_t *_u16Window;                        ///< register window, windowSize() registers
+    uint8_t  _u8Entries;                         ///< capacity in entries
+    uint8_t  _u8Next;                            ///< ring index of the next entry
+};
+#endif
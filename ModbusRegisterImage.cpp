@@ -0,0 +1,281 @@
+/**
+@file
+Register image of polled blocks with consistent snapshots for readers.
+*/
+/*
+
+  ModbusRegisterImage.cpp - Register image of polled blocks with consistent
+  snapshots for readers.
+
+  This file is part of ModbusTCP.
+
+  ModbusTCP is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  ModbusTCP is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ModbusTCP.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/* _____PROJECT INCLUDES_____________________________________________________ */
+#include "ModbusRegisterImage.h"
+
+
+
+/* _____PUBLIC FUNCTIONS_____________________________________________________ */
+
+/**
+Constructor.
+
+@param blocks block table, e.g. a static array
+@param u8MaxBlocks number of entries in the block table
+@param u16Storage register values of all blocks, e.g. a static array
+@param u16Size size of u16Storage in registers
+@ingroup image
+*/
+ModbusRegisterImage::ModbusRegisterImage(ModbusImageBlock *blocks,
+  uint8_t u8MaxBlocks, uint16_t *u16Storage, uint16_t u16Size)
+{
+  _blocks = blocks;
+  _u8MaxBlocks = u8MaxBlocks;
+  _u8Blocks = 0;
+  _u16Storage = u16Storage;
+  _u16Size = u16Size;
+  _u16Used = 0;
+}
+
+
+/**
+Add a register block to the image.
+
+Blocks are added once during setup, before anything is published or read.
+Its registers read as 0 until the first publish.
+
+@param u16Address address of the first register
+@param u8Qty quantity of registers
+@return block index; ModbusRegisterImage::NoBlock if the block table or storage is full
+@ingroup image
+*/
+uint8_t ModbusRegisterImage::addBlock(uint16_t u16Address, uint8_t u8Qty)
+{
+  ModbusImageBlock *block;
+  uint8_t i;
+
+  if (_u8Blocks >= _u8MaxBlocks || _u8Blocks == NoBlock ||
+    _u16Size - _u16Used < u8Qty)
+  {
+    return NoBlock;
+  }
+
+  block = &_blocks[_u8Blocks];
+  block->u16Address = u16Address;
+  block->u8Qty = u8Qty;
+  block->u16Offset = _u16Used;
+  block->u8Sequence = 0;
+  block->u32Time = 0;
+  for (i = 0; i < u8Qty; i++)
+  {
+    _u16Storage[_u16Used + i] = 0;
+  }
+  _u16Used += u8Qty;
+  return _u8Blocks++;
+}
+
+
+/**
+Find the block holding a register range.
+
+@param u16Address address of the first register
+@param u8Qty quantity of registers
+@return block index; ModbusRegisterImage::NoBlock if no block holds the whole range
+@ingroup image
+*/
+uint8_t ModbusRegisterImage::findBlock(uint16_t u16Address, uint8_t u8Qty)
+{
+  uint8_t i;
+
+  for (i = 0; i < _u8Blocks; i++)
+  {
+    if (u16Address >= _blocks[i].u16Address &&
+      (uint32_t)u16Address + u8Qty <=
+      (uint32_t)_blocks[i].u16Address + _blocks[i].u8Qty)
+    {
+      return i;
+    }
+  }
+  return NoBlock;
+}
+
+
+/**
+Publish new values of a block.
+
+@param u8Block block index returned by addBlock()
+@param u16Values register values, as many as the block holds
+@ingroup image
+*/
+void ModbusRegisterImage::publish(uint8_t u8Block, const uint16_t *u16Values)
+{
+  ModbusImageBlock *block;
+  uint8_t i;
+
+  if (u8Block >= _u8Blocks)
+  {
+    return;
+  }
+  block = beginWrite(u8Block);
+  for (i = 0; i < block->u8Qty; i++)
+  {
+    _u16Storage[block->u16Offset + i] = u16Values[i];
+  }
+  endWrite(block);
+}
+
+
+/**
+Copy a consistent snapshot of a block.
+
+@param u8Block block index returned by addBlock()
+@param u16Dest destination, as many registers as the block holds
+@param u32Time millis() of the publish the snapshot stems from (optional)
+@return true on success; false if the block is being written, e.g. when called from an interrupt handler that interrupted publish()
+@ingroup image
+*/
+bool ModbusRegisterImage::read(uint8_t u8Block, uint16_t *u16Dest,
+  uint32_t *u32Time)
+{
+  if (u8Block >= _u8Blocks)
+  {
+    return false;
+  }
+  return snapshot(&_blocks[u8Block], 0, _blocks[u8Block].u8Qty, u16Dest,
+    u32Time);
+}
+
+
+/**
+Copy a consistent snapshot of a register range.
+
+@param u16Address address of the first register
+@param u8Qty quantity of registers
+@param u16Dest destination, u8Qty registers
+@return true on success; false if no block holds the whole range or it is being written
+@ingroup image
+*/
+bool ModbusRegisterImage::readRegisters(uint16_t u16Address, uint8_t u8Qty,
+  uint16_t *u16Dest)
+{
+  uint8_t u8Block = findBlock(u16Address, u8Qty);
+
+  if (u8Block == NoBlock)
+  {
+    return false;
+  }
+  return snapshot(&_blocks[u8Block], u16Address - _blocks[u8Block].u16Address,
+    u8Qty, u16Dest, 0);
+}
+
+
+/**
+Retrieve sequence number of a block.
+
+The number changes with every publish, so a reader can skip blocks it
+has already seen. It is a single byte and can be read at any time; it
+wraps from 254 to 2, so it is 0 only before the first publish.
+
+@param u8Block block index returned by addBlock()
+@return sequence number; 0 if never published
+@ingroup image
+*/
+uint8_t ModbusRegisterImage::getSequence(uint8_t u8Block)
+{
+  if (u8Block >= _u8Blocks)
+  {
+    return 0;
+  }
+  return _blocks[u8Block].u8Sequence;
+}
+
+
+/* _____PRIVATE FUNCTIONS____________________________________________________ */
+/**
+Copy registers of a block, retrying if a publish overlaps the copy.
+
+@param block block
+@param u8Index index of the first register in the block
+@param u8Qty quantity of registers
+@param u16Dest destination
+@param u32Time millis() of the publish (optional)
+@return true if the copy is consistent
+*/
+bool ModbusRegisterImage::snapshot(ModbusImageBlock *block, uint8_t u8Index,
+  uint8_t u8Qty, uint16_t *u16Dest, uint32_t *u32Time)
+{
+  uint8_t u8Sequence, u8Retry, i;
+  uint32_t u32Published;
+
+  for (u8Retry = 0; u8Retry < ku8ReadRetries; u8Retry++)
+  {
+    u8Sequence = block->u8Sequence;
+    if (u8Sequence & 1)
+    {
+      // a writer interrupted by the caller would never finish
+      return false;
+    }
+    barrier();
+    for (i = 0; i < u8Qty; i++)
+    {
+      u16Dest[i] = _u16Storage[block->u16Offset + u8Index + i];
+    }
+    u32Published = block->u32Time;
+    barrier();
+    if (block->u8Sequence == u8Sequence)
+    {
+      if (u32Time)
+      {
+        *u32Time = u32Published;
+      }
+      return true;
+    }
+  }
+  return false;
+}
+
+
+/**
+Mark a block as being written.
+
+@param u8Block block index
+@return block
+*/
+ModbusImageBlock *ModbusRegisterImage::beginWrite(uint8_t u8Block)
+{
+  ModbusImageBlock *block = &_blocks[u8Block];
+
+  block->u8Sequence = block->u8Sequence + 1;
+  barrier();
+  return block;
+}
+
+
+/**
+Mark a block as consistent again.
+
+@param block block
+*/
+void ModbusRegisterImage::endWrite(ModbusImageBlock *block)
+{
+  uint8_t u8Sequence = block->u8Sequence + 1;
+
+  block->u32Time = millis();
+  barrier();
+  // 0 means never published
+  block->u8Sequence = u8Sequence ? u8Sequence : 2;
+}
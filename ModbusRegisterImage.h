@@ -0,0 +1,149 @@
+/**
+@file
+Register image of polled blocks with consistent snapshots for readers.
+
+@defgroup image ModbusRegisterImage Register Image
+*/
+/*
+
+  ModbusRegisterImage.h - Register image of polled blocks with consistent
+  snapshots for readers.
+
+  This file is part of ModbusTCP.
+
+  ModbusTCP is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  ModbusTCP is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ModbusTCP.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+
+#ifndef Modbus_RegisterImage_h
+#define Modbus_RegisterImage_h
+
+
+/* _____STANDARD INCLUDES____________________________________________________ */
+// include types & constants of Wiring core API
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "Arduino.h"
+#else
+#include "WProgram.h"
+#endif
+
+
+/* _____TYPE DEFINITIONS_____________________________________________________ */
+/**
+One register block of a ModbusRegisterImage.
+
+@ingroup image
+*/
+struct ModbusImageBlock
+{
+  uint16_t u16Address;                 ///< address of the first register
+  uint8_t  u8Qty;                      ///< quantity of registers
+  uint16_t u16Offset;                  ///< offset of the block in the image storage
+  volatile uint8_t u8Sequence;         ///< odd while the block is written
+  uint32_t u32Time;                    ///< millis() of the last publish
+};
+
+
+/* _____CLASS DEFINITIONS____________________________________________________ */
+/**
+Holds the latest values of several polled register blocks in storage you
+provide, so the rest of the sketch reads them from one place instead of
+polling the server again.
+
+Every block is guarded by a sequence number (seqlock): the poller makes it
+odd before and even again after writing the block, and a reader copies the
+block and checks that the number was even and did not change meanwhile.
+Readers never block the poller and never see half-written blocks, even
+from an interrupt handler that interrupts publish(). Such a reader gets
+false and tries again later, since waiting would never end.
+
+@ingroup image
+*/
+class ModbusRegisterImage
+{
+  public:
+
+    ModbusRegisterImage(ModbusImageBlock *, uint8_t, uint16_t *, uint16_t);
+
+    uint8_t  addBlock(uint16_t, uint8_t);
+    uint8_t  findBlock(uint16_t, uint8_t);
+    void     publish(uint8_t, const uint16_t *);
+    bool     read(uint8_t, uint16_t *, uint32_t *u32Time = 0);
+    bool     readRegisters(uint16_t, uint8_t, uint16_t *);
+    uint8_t  getSequence(uint8_t);
+
+    /**
+    Publish register values to a block.
+
+    Needed next to publish(uint8_t, Source &), which would otherwise take a
+    non-const array or pointer for a response buffer source.
+
+    @param u8Block block index returned by addBlock()
+    @param u16Values one value per register of the block
+    */
+    void publish(uint8_t u8Block, uint16_t *u16Values)
+    {
+      publish(u8Block, (const uint16_t *)u16Values);
+    }
+
+    /**
+    Publish the values in a response buffer to a block.
+
+    @param u8Block block index returned by addBlock()
+    @param src any object with getResponseBuffer(), e.g. a ModbusTCP after a successful read
+    */
+    template <class Source>
+    void publish(uint8_t u8Block, Source &src)
+    {
+      ModbusImageBlock *block;
+      uint8_t i;
+
+      if (u8Block >= _u8Blocks)
+      {
+        return;
+      }
+      block = beginWrite(u8Block);
+      for (i = 0; i < block->u8Qty; i++)
+      {
+        _u16Storage[block->u16Offset + i] = src.getResponseBuffer(i);
+      }
+      endWrite(block);
+    }
+
+    static const uint8_t NoBlock = 0xFF;         ///< returned by addBlock() and findBlock() on failure
+    static const uint8_t ku8ReadRetries = 3;     ///< attempts when the block changes during read()
+
+  private:
+
+    ModbusImageBlock *_blocks;                   ///< block table
+    uint8_t  _u8MaxBlocks;                       ///< size of block table
+    uint8_t  _u8Blocks;                          ///< blocks in use
+    uint16_t *_u16Storage;                       ///< register values of all blocks
+    uint16_t _u16Size;                           ///< size of storage in registers
+    uint16_t _u16Used;                           ///< registers in use
+
+    bool     snapshot(ModbusImageBlock *, uint8_t, uint8_t, uint16_t *, uint32_t *);
+    ModbusImageBlock *beginWrite(uint8_t);
+    void     endWrite(ModbusImageBlock *);
+
+    /**
+    Keep the compiler from moving memory accesses across the sequence updates.
+    */
+    static inline void barrier()
+    {
+      __asm__ __volatile__("" ::: "memory");
+    }
+};
+#endif
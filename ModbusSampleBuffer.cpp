@@ -0,0 +1,264 @@
+/**
+@file
+Delta/run-length encoded history of polled register blocks.
+*/
+/*
+
+  ModbusSampleBuffer.cpp - Delta/run-length encoded history of polled
+  register blocks.
+
+  This file is part of ModbusTCP.
+
+  ModbusTCP is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  ModbusTCP is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ModbusTCP.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/* _____PROJECT INCLUDES_____________________________________________________ */
+#include "ModbusSampleBuffer.h"
+
+
+
+/* _____PUBLIC FUNCTIONS_____________________________________________________ */
+
+/**
+Constructor.
+
+@param u8Storage buffer holding the encoded samples, e.g. a static array
+@param u16Size size of u8Storage in bytes
+@param u16Last u8Qty words to keep the previous sample in
+@param u16Address address of the first register of the block
+@param u8Qty quantity of registers in the block
+@ingroup samples
+*/
+ModbusSampleBuffer::ModbusSampleBuffer(uint8_t *u8Storage, uint16_t u16Size,
+  uint16_t *u16Last, uint16_t u16Address, uint8_t u8Qty)
+{
+  _u8Storage = u8Storage;
+  _u16Size = u16Size;
+  _u16Last = u16Last;
+  _u16Address = u16Address;
+  _u8Qty = u8Qty;
+  clear();
+}
+
+
+/**
+Add a new sample.
+
+@param u16Values u8Qty register values
+@return true if the sample was stored; false if it did not fit
+@ingroup samples
+*/
+bool ModbusSampleBuffer::add(const uint16_t *u16Values)
+{
+  uint8_t i;
+
+  if (!beginSample())
+  {
+    return false;
+  }
+  for (i = 0; i < _u8Qty; i++)
+  {
+    encode(i, u16Values[i]);
+  }
+  endSample();
+  return true;
+}
+
+
+/**
+Retrieve number of encoded bytes waiting to be read.
+
+@return byte count
+@ingroup samples
+*/
+uint16_t ModbusSampleBuffer::available()
+{
+  return _u16Used;
+}
+
+
+/**
+Remove the oldest encoded bytes from the buffer.
+
+Chunks may end in the middle of a sample; the concatenated chunks form
+the stream described at ModbusSampleBuffer.
+
+@param u8Chunk destination
+@param u16Size size of u8Chunk
+@return bytes copied
+@ingroup samples
+*/
+uint16_t ModbusSampleBuffer::read(uint8_t *u8Chunk, uint16_t u16Size)
+{
+  uint16_t i;
+
+  if (u16Size > _u16Used)
+  {
+    u16Size = _u16Used;
+  }
+  for (i = 0; i < u16Size; i++)
+  {
+    u8Chunk[i] = _u8Storage[_u16Head];
+    _u16Head = (_u16Head + 1) % _u16Size;
+  }
+  _u16Used -= u16Size;
+  return u16Size;
+}
+
+
+/**
+Discard all samples.
+
+The next sample is stored as a keyframe.
+
+@ingroup samples
+*/
+void ModbusSampleBuffer::clear()
+{
+  _u16Head = 0;
+  _u16Used = 0;
+  _u16DroppedCount = 0;
+  _bKeyframe = true;
+}
+
+
+/**
+Retrieve number of samples lost.
+
+@return samples that did not fit into the buffer
+@ingroup samples
+*/
+uint16_t ModbusSampleBuffer::getDroppedCount()
+{
+  return _u16DroppedCount;
+}
+
+
+/* _____PRIVATE FUNCTIONS____________________________________________________ */
+/**
+Start a sample, if the largest possible encoding fits.
+
+Flags, address, quantity and time take at most 11 bytes, each register
+at most a token and a three-byte varint.
+
+@return true if the sample can be encoded
+*/
+bool ModbusSampleBuffer::beginSample()
+{
+  uint32_t u32Now = millis();
+
+  if (_u16Size - _u16Used < 11 + 4 * (uint16_t)_u8Qty)
+  {
+    _u16DroppedCount++;
+    _bKeyframe = true;
+    return false;
+  }
+
+  if (_bKeyframe)
+  {
+    put(SampleKeyframe);
+    putVarint(_u16Address);
+    putVarint(_u8Qty);
+    putVarint(u32Now);
+  }
+  else
+  {
+    put(0);
+    putVarint(u32Now - _u32LastTime);
+  }
+  _u32LastTime = u32Now;
+  _u8RunLength = 0;
+  return true;
+}
+
+
+/**
+Encode the value of one register.
+
+@param u8Index register index in the block
+@param u16Value register value
+*/
+void ModbusSampleBuffer::encode(uint8_t u8Index, uint16_t u16Value)
+{
+  uint16_t u16Previous = _bKeyframe ? 0 : _u16Last[u8Index];
+  bool bChanged = (u16Value != u16Previous);
+  int16_t i16Delta = (int16_t)(u16Value - u16Previous);
+
+  if (_u8RunLength && (bChanged != _bRunChanged || _u8RunLength == 128))
+  {
+    endRun();
+  }
+  if (!_u8RunLength)
+  {
+    // token is filled in when the run ends
+    _u16TokenOffset = (_u16Head + _u16Used) % _u16Size;
+    put(0);
+    _bRunChanged = bChanged;
+  }
+  _u8RunLength++;
+
+  if (bChanged)
+  {
+    putVarint((uint16_t)((uint16_t)i16Delta << 1) ^ (uint16_t)(i16Delta >> 15));
+  }
+  _u16Last[u8Index] = u16Value;
+}
+
+
+/**
+Finish a sample.
+*/
+void ModbusSampleBuffer::endSample()
+{
+  if (_u8RunLength)
+  {
+    endRun();
+  }
+  _bKeyframe = false;
+}
+
+
+/**
+Write the token of the run in progress.
+*/
+void ModbusSampleBuffer::endRun()
+{
+  _u8Storage[_u16TokenOffset] = (_bRunChanged ? 0x00 : 0x80) | (_u8RunLength - 1);
+  _u8RunLength = 0;
+}
+
+
+/**
+Append byte to the FIFO.
+*/
+void ModbusSampleBuffer::put(uint8_t u8Value)
+{
+  _u8Storage[(uint16_t) ((_u16Head + _u16Used) % _u16Size)] = u8Value;
+  _u16Used++;
+}
+
+
+/**
+Append unsigned value, 7 bits per byte.
+*/
+void ModbusSampleBuffer::putVarint(uint32_t u32Value)
+{
+  while (u32Value > 0x7F)
+  {
+    put(0x80 | (u32Value & 0x7F));
+    u32Value >>= 7;
+  }
+  put(u32Value);
+}
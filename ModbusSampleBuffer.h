@@ -0,0 +1,146 @@
+/**
+@file
+Delta/run-length encoded history of polled register blocks.
+
+@defgroup samples ModbusSampleBuffer Register History
+*/
+/*
+
+  ModbusSampleBuffer.h - Delta/run-length encoded history of polled
+  register blocks.
+
+  This file is part of ModbusTCP.
+
+  ModbusTCP is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  ModbusTCP is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ModbusTCP.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+
+#ifndef Modbus_SampleBuffer_h
+#define Modbus_SampleBuffer_h
+
+
+/* _____STANDARD INCLUDES____________________________________________________ */
+// include types & constants of Wiring core API
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "Arduino.h"
+#else
+#include "WProgram.h"
+#endif
+
+
+/* _____CLASS DEFINITIONS____________________________________________________ */
+/**
+Keeps timestamped samples of one register block in a caller-supplied
+FIFO, each encoded against the previous sample, and hands them out as a
+byte stream in chunks of any size.
+
+The stream is a sequence of samples:
+  - flags (1 byte): ModbusSampleBuffer::SampleKeyframe if the sample does
+    not depend on the previous one
+  - keyframe only: register address, quantity (varint each)
+  - time (varint): millis() for a keyframe, milliseconds since the previous
+    sample otherwise
+  - runs covering all registers of the block, each starting with a token
+    byte: 0x80 | (n - 1) for n registers unchanged, or n - 1 followed by n
+    varints of the zigzag-encoded difference to the previous value (to 0
+    in a keyframe)
+
+Varints are 7 bits per byte, least significant first, with bit 7 set on
+all but the last byte. Zigzag maps a difference d (as int16_t) to
+(d << 1) ^ (d >> 15).
+
+A block that has not changed since the previous sample takes two or
+three bytes. When a sample does not fit, it is dropped and the next
+stored sample is a keyframe, so the stream stays decodable.
+
+@ingroup samples
+*/
+class ModbusSampleBuffer
+{
+  public:
+
+    ModbusSampleBuffer(uint8_t *, uint16_t, uint16_t *, uint16_t, uint8_t);
+
+    bool     add(const uint16_t *);
+    uint16_t available();
+    uint16_t read(uint8_t *, uint16_t);
+    void     clear();
+    uint16_t getDroppedCount();
+
+    /**
+    Add register values as a new sample.
+
+    Needed next to add(Source &), which would otherwise take a non-const
+    array or pointer for a response buffer source.
+
+    @param u16Values one value per register of the block
+    @return true if the sample was stored; false if it did not fit
+    */
+    bool add(uint16_t *u16Values)
+    {
+      return add((const uint16_t *)u16Values);
+    }
+
+    /**
+    Add the values in a response buffer as a new sample.
+
+    @param src any object with getResponseBuffer(), e.g. a ModbusTCP after a successful read
+    @return true if the sample was stored; false if it did not fit
+    */
+    template <class Source>
+    bool add(Source &src)
+    {
+      uint8_t i;
+
+      if (!beginSample())
+      {
+        return false;
+      }
+      for (i = 0; i < _u8Qty; i++)
+      {
+        encode(i, src.getResponseBuffer(i));
+      }
+      endSample();
+      return true;
+    }
+
+    static const uint8_t SampleKeyframe = 0x01;  ///< sample holds absolute values
+
+  private:
+
+    uint8_t *_u8Storage;                         ///< FIFO
+    uint16_t _u16Size;                           ///< size of FIFO
+    uint16_t _u16Head;                           ///< offset of oldest byte
+    uint16_t _u16Used;                           ///< bytes in use
+    uint16_t *_u16Last;                          ///< values of the previous sample, one per register
+    uint16_t _u16Address;                        ///< address of the first register of the block
+    uint8_t  _u8Qty;                             ///< registers in the block
+    bool     _bKeyframe;                         ///< next sample must be a keyframe
+    uint32_t _u32LastTime;                       ///< millis() of the previous sample
+    uint16_t _u16DroppedCount;                   ///< samples that did not fit
+
+    // run being encoded
+    uint16_t _u16TokenOffset;                    ///< FIFO offset of the run's token byte
+    uint8_t  _u8RunLength;                       ///< registers in the run, 0 if none
+    bool     _bRunChanged;                       ///< run holds differences
+
+    bool     beginSample();
+    void     encode(uint8_t, uint16_t);
+    void     endSample();
+    void     endRun();
+    void     put(uint8_t);
+    void     putVarint(uint32_t);
+};
+#endif
@@ -33,6 +33,23 @@ Arduino library for communicating with Modbus server over Ethernet in TCP.
 #include "ModbusTCP.h"
 
 
+/* _____LOCAL DEFINITIONS____________________________________________________ */
+#if MODBUSTCP_DEBUG
+#define MBDebugPrint(x)    Serial.print(x)
+#define MBDebugPrintln(x)  Serial.println(x)
+#else
+#define MBDebugPrint(x)    do { } while (0)
+#define MBDebugPrintln(x)  do { } while (0)
+#endif
+
+
+/* _____STATIC MEMBERS_______________________________________________________ */
+#if MODBUSTCP_SHARED_BUFFERS
+uint8_t  ModbusTCP::_u8ModbusADU[256];
+uint16_t ModbusTCP::_u16TxRxBuffer[MaxBufferSize];
+#endif
+
+
 
 /* _____PUBLIC FUNCTIONS_____________________________________________________ */
 
@@ -43,6 +60,50 @@ ModbusTCP::ModbusTCP(void)
 {
   _u8MBUnitID = 1;
   _u16MBTransactionID = 1;
+#if MODBUSTCP_DIAGNOSTICS
+  _deviceIdSink = 0;
+#endif
+  _u8BufferOffset = 0;
+  _prepared = 0;
+  _homeCache = 0;
+  _u16ConnectedPort = 0;
+  _client = &ModbusClient;
+#if MODBUSTCP_TLS
+  // resume the TLS session on reconnect; keep the connection to avoid handshakes
+  ModbusClient.setSession(&_tlsSession);
+#if MODBUSTCP_FAILOVER
+  ModbusStandbyClient.setSession(&_tlsStandbySession);
+#endif
+  _bKeepAlive = true;
+#else
+  _bKeepAlive = false;
+#endif
+#if MODBUSTCP_NONBLOCKING
+  _bNonBlocking = false;
+  _u8State = ku8StateIdle;
+  _u32MaxServiceTime = 0;
+#endif
+#if MODBUSTCP_PIPELINING
+  _u8MaxInFlight = 4;
+#endif
+  _u32TransactionCount = 0;
+  _u16TimeoutCount = 0;
+  _u32ConnectCount = 0;
+#if MODBUSTCP_FAILOVER
+  _bBackupConfigured = false;
+  _u8FailbackPolicy = MBFailbackInterval;
+  _u32FailbackInterval = 30000;
+  _u32StandbyCheck = 0;
+  _u16FailoverCount = 0;
+  _u32LastFailoverTime = 0;
+  _u32MaxFailoverTime = 0;
+#endif
+#if MODBUSTCP_CAPTURE
+  _capture = 0;
+#endif
+  _cache = &_ownCache;
+  _u16ServerPort = ku16MBServerPort;
+  clearServerCache();
 }
 
 
@@ -58,6 +119,50 @@ Creates class object using Modbus Unit ID. This is for unique identification
 ModbusTCP::ModbusTCP(uint8_t u8MBUnitID)
 {
   _u8MBUnitID = u8MBUnitID;
+#if MODBUSTCP_DIAGNOSTICS
+  _deviceIdSink = 0;
+#endif
+  _u8BufferOffset = 0;
+  _prepared = 0;
+  _homeCache = 0;
+  _u16ConnectedPort = 0;
+  _client = &ModbusClient;
+#if MODBUSTCP_TLS
+  // resume the TLS session on reconnect; keep the connection to avoid handshakes
+  ModbusClient.setSession(&_tlsSession);
+#if MODBUSTCP_FAILOVER
+  ModbusStandbyClient.setSession(&_tlsStandbySession);
+#endif
+  _bKeepAlive = true;
+#else
+  _bKeepAlive = false;
+#endif
+#if MODBUSTCP_NONBLOCKING
+  _bNonBlocking = false;
+  _u8State = ku8StateIdle;
+  _u32MaxServiceTime = 0;
+#endif
+#if MODBUSTCP_PIPELINING
+  _u8MaxInFlight = 4;
+#endif
+  _u32TransactionCount = 0;
+  _u16TimeoutCount = 0;
+  _u32ConnectCount = 0;
+#if MODBUSTCP_FAILOVER
+  _bBackupConfigured = false;
+  _u8FailbackPolicy = MBFailbackInterval;
+  _u32FailbackInterval = 30000;
+  _u32StandbyCheck = 0;
+  _u16FailoverCount = 0;
+  _u32LastFailoverTime = 0;
+  _u32MaxFailoverTime = 0;
+#endif
+#if MODBUSTCP_CAPTURE
+  _capture = 0;
+#endif
+  _cache = &_ownCache;
+  _u16ServerPort = ku16MBServerPort;
+  clearServerCache();
 }
 
 
@@ -69,12 +174,154 @@ void ModbusTCP::setUnitId(uint8_t u8MBUnitID)
 }
 
 
+/**
+Set the IP address of the Modbus server.
+
+Everything learned about the previous server (supported function codes,
+identification) is forgotten when the address changes, and an open 
+connection to it is closed.
+
+@param ipAddr IP address of the Modbus server
+@ingroup setup
+*/
 void ModbusTCP::setServerIPAddress(IPAddress ipAddr)
 {
+  if (serverIP != ipAddr)
+  {
+    disconnectServer();
+    clearServerCache();
+  }
   serverIP = ipAddr;
 }
 
 
+/**
+Set the TCP port of the Modbus server.
+
+The default is 502 (802 with MODBUSTCP_TLS). A different port usually 
+means a different device, e.g. behind port forwarding, so everything 
+learned about the server is forgotten when the port changes.
+
+@param u16Port TCP port of the Modbus server
+@ingroup setup
+*/
+void ModbusTCP::setServerPort(uint16_t u16Port)
+{
+  if (_u16ServerPort != u16Port)
+  {
+    disconnectServer();
+    clearServerCache();
+  }
+  _u16ServerPort = u16Port;
+}
+
+
+#if MODBUSTCP_FAILOVER
+/**
+Set the IP address of the backup Modbus server.
+
+The backup is kept connected as hot standby while the primary server 
+(ModbusTCP::setServerIPAddress()) is active. When the primary fails to 
+connect or to respond, the transaction is repeated on the backup right 
+away and the backup stays active, see ModbusTCP::setFailbackPolicy(). 
+The standby connection is opened by this call.
+
+@param ipAddr IP address of the backup Modbus server
+@ingroup setup
+*/
+void ModbusTCP::setBackupServerIPAddress(IPAddress ipAddr)
+{
+  if (_bBackupConfigured && _backupServerIP != ipAddr)
+  {
+    ModbusStandbyClient.stop();
+  }
+  _backupServerIP = ipAddr;
+  _bBackupConfigured = true;
+
+  // open the standby connection right away
+  if (_client == &ModbusClient && !ModbusStandbyClient.connected())
+  {
+    _u32StandbyCheck = millis();
+    ModbusStandbyClient.connect(_backupServerIP, _u16ServerPort);
+  }
+}
+
+
+/**
+Set when to return from the backup to the primary server.
+
+@param u8Policy ModbusTCP::MBFailbackNever to stay on the backup until it fails, ModbusTCP::MBFailbackInterval to try the primary periodically
+@param u32Interval time between attempts to reach the primary [milliseconds]
+@ingroup setup
+*/
+void ModbusTCP::setFailbackPolicy(uint8_t u8Policy, uint32_t u32Interval)
+{
+  _u8FailbackPolicy = u8Policy;
+  _u32FailbackInterval = u32Interval;
+}
+
+
+/**
+Check whether the backup server is active.
+
+@return true while transactions go to the backup server
+@ingroup setup
+*/
+bool ModbusTCP::isOnBackup()
+{
+  return _client != &ModbusClient;
+}
+
+
+/**
+Retrieve number of switches from the primary to the backup server.
+
+@return failover count
+@ingroup setup
+*/
+uint16_t ModbusTCP::getFailoverCount()
+{
+  return _u16FailoverCount;
+}
+
+
+/**
+Retrieve duration of the last failover.
+
+Measured from the start of the transaction that failed on the primary to 
+the switch to the backup.
+
+@return duration [milliseconds]
+@ingroup setup
+*/
+uint32_t ModbusTCP::getLastFailoverTime()
+{
+  return _u32LastFailoverTime;
+}
+
+
+/**
+Retrieve duration of the slowest failover.
+
+@return duration [milliseconds]
+@ingroup setup
+*/
+uint32_t ModbusTCP::getMaxFailoverTime()
+{
+  return _u32MaxFailoverTime;
+}
+#endif
+
+
+/**
+Set transaction identifier of the next request.
+
+The identifier is incremented with every request, so a response that 
+arrives after its request timed out is recognized and dropped.
+
+@param transactionID transaction identifier (0x0000..0xFFFF)
+@ingroup setup
+*/
 void ModbusTCP::setTransactionID(uint16_t transactionID)
 {
   _u16MBTransactionID = transactionID;
@@ -96,6 +343,150 @@ void ModbusTCP::idle(void (*idle)())
   _idle = idle;
 }
 
+
+/**
+Keep the connection open between transactions.
+
+By default the connection is closed after every transaction (except on 
+ENC28J60, and with MODBUSTCP_TLS, where keep-alive is the default so the 
+TLS handshake is not repeated for every poll). With keep-alive, it stays 
+open and is only re-opened when the server has closed it. Responses that 
+arrive late, in pieces or together with others are sorted out by 
+transaction identifier, see ModbusFramer.
+
+@param bKeepAlive true to keep the connection open
+@ingroup setup
+*/
+void ModbusTCP::setKeepAlive(bool bKeepAlive)
+{
+  _bKeepAlive = bKeepAlive;
+}
+
+
+/**
+Retrieve number of requests sent.
+
+Together with millis() this gives the throughput of a long-running poll 
+loop.
+
+@return transaction count, since construction
+@ingroup setup
+*/
+uint32_t ModbusTCP::getTransactionCount()
+{
+  return _u32TransactionCount;
+}
+
+
+/**
+Retrieve number of requests that got no matching response.
+
+@return count of ModbusTCP::MBResponseTimedOut and ModbusTCP::MBInvalidTransactionID results
+@ingroup setup
+*/
+uint16_t ModbusTCP::getTimeoutCount()
+{
+  return _u16TimeoutCount;
+}
+
+
+/**
+Retrieve number of connections opened.
+
+Grows with every transaction unless the connection is kept open 
+(ModbusTCP::setKeepAlive(), ENC28J60); growing anyway points to a server 
+closing connections.
+
+@return connect count
+@ingroup setup
+*/
+uint32_t ModbusTCP::getConnectCount()
+{
+  return _u32ConnectCount;
+}
+
+
+/**
+Retrieve number of bytes skipped while searching for a valid response header.
+
+@return garbage byte count, see ModbusFramer
+@ingroup setup
+*/
+uint16_t ModbusTCP::getResyncCount()
+{
+  return _framer.getResyncCount();
+}
+
+
+#if MODBUSTCP_PIPELINING
+/**
+Set how many requests may be outstanding at once.
+
+Applies to requests addressed to several units, e.g. 
+ModbusTCP::readHoldingRegisters(const uint8_t *, uint8_t, uint16_t, uint16_t, void (*)(uint8_t, uint8_t)). 
+Gateways queue or reject requests beyond their own limit; check its 
+documentation.
+
+@param u8MaxInFlight outstanding requests (1..ModbusFramer::ku8TransactionWindow)
+@ingroup setup
+*/
+void ModbusTCP::setMaxInFlight(uint8_t u8MaxInFlight)
+{
+  _u8MaxInFlight = constrain(u8MaxInFlight, 1, ModbusFramer::ku8TransactionWindow);
+}
+#endif
+
+
+#if MODBUSTCP_NONBLOCKING
+/**
+Select non-blocking mode.
+
+In non-blocking mode, a request function only starts the transaction and 
+returns ModbusTCP::MBTransactionPending; call ModbusTCP::service() from 
+loop() until it returns the result. The transmit buffer must not change 
+until then. Requests are not split to the server's request size limit, 
+Read Device Identification reads one part only, and the failover backup 
+is not used. Gateway scans, change journal reads and file record 
+transfers always block; while a transaction is pending they return 
+ModbusTCP::MBTransactionBusy.
+
+@param bNonBlocking true for non-blocking mode
+@ingroup setup
+*/
+void ModbusTCP::setNonBlocking(bool bNonBlocking)
+{
+  _bNonBlocking = bNonBlocking;
+}
+
+
+/**
+Retrieve duration of the longest ModbusTCP::service() call.
+
+@return duration [microseconds]
+@ingroup setup
+*/
+uint32_t ModbusTCP::getMaxServiceTime()
+{
+  return _u32MaxServiceTime;
+}
+#endif
+
+
+#if MODBUSTCP_CAPTURE
+/**
+Set traffic recorder.
+
+Every request and response ADU is passed to the recorder together with a 
+timestamp, see ModbusCapture. Pass 0 to stop recording.
+
+@param capture recorder, e.g. ModbusCapture over a static buffer
+*/
+void ModbusTCP::setCapture(ModbusCapture *capture)
+{
+  _capture = capture;
+}
+#endif
+
 /**
 Retrieve data from response buffer.
 
@@ -189,6 +580,7 @@ void ModbusTCP::clearTransmitBuffer()
 }
 
 
+#if MODBUSTCP_COILS
 /**
 Modbus function 0x01 Read Coils.
 
@@ -250,6 +642,7 @@ uint8_t ModbusTCP::readDiscreteInputs(uint16_t u16ReadAddress,
   _u16ReadQty = u16BitQty;
   return ModbusMasterTransaction(MBReadDiscreteInputs);
 }
+#endif
 
 
 /**
@@ -263,17 +656,19 @@ starting at zero.
 The register data in the response buffer is packed as one word per 
 register.
 
+Requests larger than the server accepts are split into several 
+transactions, see ModbusTCP::setRequestLimit().
+
 @param u16ReadAddress address of the first holding register (0x0000..0xFFFF)
-@param u16ReadQty quantity of holding registers to read (1..125, enforced by remote device)
+@param u16ReadQty quantity of holding registers to read (1..64, limited by the response buffer)
 @return 0 on success; exception number on failure
 @ingroup register
 */
 uint8_t ModbusTCP::readHoldingRegisters(uint16_t u16ReadAddress,
   uint16_t u16ReadQty)
 {
-  _u16ReadAddress = u16ReadAddress;
-  _u16ReadQty = u16ReadQty;
-  return ModbusMasterTransaction(MBReadHoldingRegisters);
+  return ModbusChunkedTransaction(MBReadHoldingRegisters, u16ReadAddress,
+    u16ReadQty);
 }
 
 
@@ -288,20 +683,89 @@ starting at zero.
 The register data in the response buffer is packed as one word per 
 register.
 
+Requests larger than the server accepts are split into several 
+transactions, see ModbusTCP::setRequestLimit().
+
 @param u16ReadAddress address of the first input register (0x0000..0xFFFF)
-@param u16ReadQty quantity of input registers to read (1..125, enforced by remote device)
+@param u16ReadQty quantity of input registers to read (1..64, limited by the response buffer)
 @return 0 on success; exception number on failure
 @ingroup register
 */
 uint8_t ModbusTCP::readInputRegisters(uint16_t u16ReadAddress,
   uint8_t u16ReadQty)
 {
+  return ModbusChunkedTransaction(MBReadInputRegisters, u16ReadAddress,
+    u16ReadQty);
+}
+
+
+#if MODBUSTCP_PIPELINING
+/**
+Modbus function 0x03 Read Holding Registers from several units.
+
+Reads the same block from each unit behind a gateway, with up to 
+ModbusTCP::setMaxInFlight() requests outstanding at once, so a scan of 
+all units takes about one round trip instead of one per unit. The unit 
+identifier set with ModbusTCP::setUnitId() is not changed.
+
+The sink is called once per unit, in the order the responses arrive. 
+On success the registers of that unit are in the response buffer while 
+the sink runs. If the gateway stops answering, units with a request 
+outstanding get ModbusTCP::MBResponseTimedOut and units whose request 
+was not sent yet get ModbusTCP::MBRequestNotSent.
+
+@param u8UnitIDs unit identifiers to read from
+@param u8Units number of unit identifiers
+@param u16ReadAddress address of the first holding register (0x0000..0xFFFF)
+@param u16ReadQty quantity of holding registers to read (1..64, limited by the response buffer)
+@param sink function called with unit identifier and result (0 on success; exception number on failure)
+@return 0 if all units succeeded; otherwise result of the first failed one
+@ingroup register
+*/
+uint8_t ModbusTCP::readHoldingRegisters(const uint8_t *u8UnitIDs,
+  uint8_t u8Units, uint16_t u16ReadAddress, uint16_t u16ReadQty,
+  void (*sink)(uint8_t, uint8_t))
+{
+  if (!u16ReadQty || u16ReadQty > MaxBufferSize)
+  {
+    return MBIllegalDataValue;
+  }
+  _u16ReadAddress = u16ReadAddress;
+  _u16ReadQty = u16ReadQty;
+  _u8BufferOffset = 0;
+  return ModbusUnitScan(MBReadHoldingRegisters, u8UnitIDs, u8Units, sink);
+}
+
+
+/**
+Modbus function 0x04 Read Input Registers from several units.
+
+@see ModbusTCP::readHoldingRegisters(const uint8_t *, uint8_t, uint16_t, uint16_t, void (*)(uint8_t, uint8_t))
+@param u8UnitIDs unit identifiers to read from
+@param u8Units number of unit identifiers
+@param u16ReadAddress address of the first input register (0x0000..0xFFFF)
+@param u16ReadQty quantity of input registers to read (1..64, limited by the response buffer)
+@param sink function called with unit identifier and result (0 on success; exception number on failure)
+@return 0 if all units succeeded; otherwise result of the first failed one
+@ingroup register
+*/
+uint8_t ModbusTCP::readInputRegisters(const uint8_t *u8UnitIDs,
+  uint8_t u8Units, uint16_t u16ReadAddress, uint16_t u16ReadQty,
+  void (*sink)(uint8_t, uint8_t))
+{
+  if (!u16ReadQty || u16ReadQty > MaxBufferSize)
+  {
+    return MBIllegalDataValue;
+  }
   _u16ReadAddress = u16ReadAddress;
   _u16ReadQty = u16ReadQty;
-  return ModbusMasterTransaction(MBReadInputRegisters);
+  _u8BufferOffset = 0;
+  return ModbusUnitScan(MBReadInputRegisters, u8UnitIDs, u8Units, sink);
 }
+#endif
 
 
+#if MODBUSTCP_COILS
 /**
 Modbus function 0x05 Write Single Coil.
 
@@ -322,6 +786,7 @@ uint8_t ModbusTCP::writeSingleCoil(uint16_t u16WriteAddress, uint8_t u8State)
   _u16WriteQty = (u8State ? 0xFF00 : 0x0000);
   return ModbusMasterTransaction(MBWriteSingleCoil);
 }
+#endif
 
 
 /**
@@ -339,6 +804,13 @@ written. Registers are addressed starting at zero.
 uint8_t ModbusTCP::writeSingleRegister(uint16_t u16WriteAddress,
   uint16_t u16WriteValue)
 {
+#if MODBUSTCP_NONBLOCKING
+  // the transmit buffer may still hold the data of the pending request
+  if (refusePending())
+  {
+    return MBTransactionBusy;
+  }
+#endif
   _u16WriteAddress = u16WriteAddress;
   _u16WriteQty = 0;
   _u16TxRxBuffer[0] = u16WriteValue;
@@ -346,6 +818,7 @@ uint8_t ModbusTCP::writeSingleRegister(uint16_t u16WriteAddress,
 }
 
 
+#if MODBUSTCP_COILS
 /**
 Modbus function 0x0F Write Multiple Coils.
 
@@ -358,17 +831,23 @@ buffer. A logical '1' in a bit position of the buffer requests the
 corresponding output to be ON. A logical '0' requests it to be OFF.
 
 @param u16WriteAddress address of the first coil (0x0000..0xFFFF)
-@param u16BitQty quantity of coils to write (1..2000, enforced by remote device)
+@param u16BitQty quantity of coils to write (1..1936, limited by the ADU and transmit buffers)
 @return 0 on success; exception number on failure
 @ingroup discrete
 */
 uint8_t ModbusTCP::writeMultipleCoils(uint16_t u16WriteAddress,
   uint16_t u16BitQty)
 {
+  if (!u16BitQty || u16BitQty > ku16MaxCoilQty ||
+    ((u16BitQty + 15) >> 4) > MaxBufferSize)
+  {
+    return MBIllegalDataValue;
+  }
   _u16WriteAddress = u16WriteAddress;
   _u16WriteQty = u16BitQty;
   return ModbusMasterTransaction(MBWriteMultipleCoils);
 }
+#endif
 
 
 /**
@@ -380,86 +859,1539 @@ to 123 registers) in a remote device.
 The requested written values are specified in the transmit buffer. Data 
 is packed as one word per register.
 
+Requests larger than the server accepts are split into several 
+transactions, see ModbusTCP::setRequestLimit(). The write is then no 
+longer atomic: on failure, the blocks before the failing one have been 
+written.
+
 @param u16WriteAddress address of the holding register (0x0000..0xFFFF)
-@param u16WriteQty quantity of holding registers to write (1..123, enforced by remote device)
+@param u16WriteQty quantity of holding registers to write (1..64, limited by the transmit buffer)
 @return 0 on success; exception number on failure
 @ingroup register
 */
 uint8_t ModbusTCP::writeMultipleRegisters(uint16_t u16WriteAddress,
   uint16_t u16WriteQty)
 {
-  _u16WriteAddress = u16WriteAddress;
-  _u16WriteQty = u16WriteQty;
-  return ModbusMasterTransaction(MBWriteMultipleRegisters);
+  return ModbusChunkedTransaction(MBWriteMultipleRegisters, u16WriteAddress,
+    u16WriteQty);
 }
 
 
 /**
-Modbus function 0x16 Mask Write Register.
-
-This function code is used to modify the contents of a specified holding 
-register using a combination of an AND mask, an OR mask, and the 
-register's current contents. The function can be used to set or clear 
-individual bits in the register.
-
-The request specifies the holding register to be written, the data to be 
-used as the AND mask, and the data to be used as the OR mask. Registers 
-are addressed starting at zero.
-
-The function's algorithm is:
-
-Result = (Current Contents && And_Mask) || (Or_Mask && (~And_Mask))
+Modbus function 0x03 Read Holding Registers from an endpoint.
 
-@param u16WriteAddress address of the holding register (0x0000..0xFFFF)
-@param u16AndMask AND mask (0x0000..0xFFFF)
-@param u16OrMask OR mask (0x0000..0xFFFF)
+@see ModbusEndpoint
+@param endpoint server to read from
+@param u16ReadAddress address of the first holding register (0x0000..0xFFFF)
+@param u16ReadQty quantity of holding registers to read (1..64, limited by the response buffer)
 @return 0 on success; exception number on failure
 @ingroup register
 */
-uint8_t ModbusTCP::maskWriteRegister(uint16_t u16WriteAddress,
-  uint16_t u16AndMask, uint16_t u16OrMask)
+uint8_t ModbusTCP::readHoldingRegisters(ModbusEndpoint &endpoint,
+  uint16_t u16ReadAddress, uint16_t u16ReadQty)
 {
-  _u16WriteAddress = u16WriteAddress;
-  _u16TxRxBuffer[0] = u16AndMask;
-  _u16TxRxBuffer[1] = u16OrMask;
-  return ModbusMasterTransaction(MBMaskWriteRegister);
+  if (!beginEndpoint(endpoint))
+  {
+    return MBTransactionBusy;
+  }
+  return endEndpoint(readHoldingRegisters(u16ReadAddress, u16ReadQty));
 }
 
 
 /**
-Modbus function 0x17 Read Write Multiple Registers.
-
-This function code performs a combination of one read operation and one 
-write operation in a single MODBUS transaction. The write operation is 
-performed before the read. Holding registers are addressed starting at 
-zero.
-
-The request specifies the starting address and number of holding 
-registers to be read as well as the starting address, and the number of 
-holding registers. The data to be written is specified in the transmit 
-buffer.
+Modbus function 0x04 Read Input Registers from an endpoint.
 
-@param u16ReadAddress address of the first holding register (0x0000..0xFFFF)
-@param u16ReadQty quantity of holding registers to read (1..125, enforced by remote device)
-@param u16WriteAddress address of the first holding register (0x0000..0xFFFF)
-@param u16WriteQty quantity of holding registers to write (1..121, enforced by remote device)
+@see ModbusEndpoint
+@param endpoint server to read from
+@param u16ReadAddress address of the first input register (0x0000..0xFFFF)
+@param u16ReadQty quantity of input registers to read (1..64, limited by the response buffer)
 @return 0 on success; exception number on failure
 @ingroup register
 */
-uint8_t ModbusTCP::readWriteMultipleRegisters(uint16_t u16ReadAddress,
-  uint16_t u16ReadQty, uint16_t u16WriteAddress, uint16_t u16WriteQty)
+uint8_t ModbusTCP::readInputRegisters(ModbusEndpoint &endpoint,
+  uint16_t u16ReadAddress, uint8_t u16ReadQty)
 {
-  _u16ReadAddress = u16ReadAddress;
-  _u16ReadQty = u16ReadQty;
-  _u16WriteAddress = u16WriteAddress;
-  _u16WriteQty = u16WriteQty;
-  return ModbusMasterTransaction(MBReadWriteMultipleRegisters);
+  if (!beginEndpoint(endpoint))
+  {
+    return MBTransactionBusy;
+  }
+  return endEndpoint(readInputRegisters(u16ReadAddress, u16ReadQty));
 }
 
 
-/* _____PRIVATE FUNCTIONS____________________________________________________ */
 /**
-Modbus transaction engine.
+Modbus function 0x06 Write Single Register to an endpoint.
+
+@see ModbusEndpoint
+@param endpoint server to write to
+@param u16WriteAddress address of the holding register (0x0000..0xFFFF)
+@param u16WriteValue value to be written to holding register (0x0000..0xFFFF)
+@return 0 on success; exception number on failure
+@ingroup register
+*/
+uint8_t ModbusTCP::writeSingleRegister(ModbusEndpoint &endpoint,
+  uint16_t u16WriteAddress, uint16_t u16WriteValue)
+{
+  if (!beginEndpoint(endpoint))
+  {
+    return MBTransactionBusy;
+  }
+  return endEndpoint(writeSingleRegister(u16WriteAddress, u16WriteValue));
+}
+
+
+/**
+Modbus function 0x10 Write Multiple Registers to an endpoint.
+
+@see ModbusEndpoint
+@param endpoint server to write to
+@param u16WriteAddress address of the holding register (0x0000..0xFFFF)
+@param u16WriteQty quantity of holding registers to write (1..64, limited by the transmit buffer)
+@return 0 on success; exception number on failure
+@ingroup register
+*/
+uint8_t ModbusTCP::writeMultipleRegisters(ModbusEndpoint &endpoint,
+  uint16_t u16WriteAddress, uint16_t u16WriteQty)
+{
+  if (!beginEndpoint(endpoint))
+  {
+    return MBTransactionBusy;
+  }
+  return endEndpoint(writeMultipleRegisters(u16WriteAddress, u16WriteQty));
+}
+
+
+/**
+Send a prepared request.
+
+The frame has been encoded in advance, see ModbusPreparedRequest; only 
+transaction and unit identifier are filled in. Requests are not split 
+per ModbusTCP::setRequestLimit(). Read values are placed in the response 
+buffer as with the corresponding read function; a read whose values do 
+not fit the response buffer is rejected.
+
+@param request prepared request
+@return 0 on success; ModbusTCP::MBIllegalDataValue if the request is not valid or too large; exception number on failure
+@ingroup register
+*/
+uint8_t ModbusTCP::execute(const ModbusPreparedRequest &request)
+{
+  uint16_t u16Qty = word(request.u8ADU[10], request.u8ADU[11]);
+  uint8_t u8MBStatus;
+
+  if (!request.u8ResponseLength)
+  {
+    return MBIllegalDataValue;
+  }
+  // the frame is fixed, so it cannot be split to the response buffer
+  if (request.u8ADU[7] == MBReadCoils || request.u8ADU[7] == MBReadDiscreteInputs)
+  {
+    u16Qty = (u16Qty + 15) >> 4;
+  }
+  else if (request.u8ADU[7] != MBReadHoldingRegisters &&
+    request.u8ADU[7] != MBReadInputRegisters)
+  {
+    u16Qty = 0;
+  }
+  if (u16Qty > MaxBufferSize)
+  {
+    return MBIllegalDataValue;
+  }
+#if MODBUSTCP_NONBLOCKING
+  // the pending request may still have to be built
+  if (refusePending())
+  {
+    return MBTransactionBusy;
+  }
+#endif
+  _u8BufferOffset = 0;
+  _prepared = &request;
+  u8MBStatus = ModbusMasterTransaction(request.u8ADU[7]);
+#if MODBUSTCP_NONBLOCKING
+  // sent later, in service()
+  if (u8MBStatus == MBTransactionPending)
+  {
+    return u8MBStatus;
+  }
+#endif
+  _prepared = 0;
+  return u8MBStatus;
+}
+
+
+/**
+Modbus function 0x16 Mask Write Register.
+
+This function code is used to modify the contents of a specified holding 
+register using a combination of an AND mask, an OR mask, and the 
+register's current contents. The function can be used to set or clear 
+individual bits in the register.
+
+The request specifies the holding register to be written, the data to be 
+used as the AND mask, and the data to be used as the OR mask. Registers 
+are addressed starting at zero.
+
+The function's algorithm is:
+
+Result = (Current Contents && And_Mask) || (Or_Mask && (~And_Mask))
+
+@param u16WriteAddress address of the holding register (0x0000..0xFFFF)
+@param u16AndMask AND mask (0x0000..0xFFFF)
+@param u16OrMask OR mask (0x0000..0xFFFF)
+@return 0 on success; exception number on failure
+@ingroup register
+*/
+uint8_t ModbusTCP::maskWriteRegister(uint16_t u16WriteAddress,
+  uint16_t u16AndMask, uint16_t u16OrMask)
+{
+#if MODBUSTCP_NONBLOCKING
+  // the transmit buffer may still hold the data of the pending request
+  if (refusePending())
+  {
+    return MBTransactionBusy;
+  }
+#endif
+  _u16WriteAddress = u16WriteAddress;
+  _u16TxRxBuffer[0] = u16AndMask;
+  _u16TxRxBuffer[1] = u16OrMask;
+  return ModbusMasterTransaction(MBMaskWriteRegister);
+}
+
+
+/**
+Modbus function 0x17 Read Write Multiple Registers.
+
+This function code performs a combination of one read operation and one 
+write operation in a single MODBUS transaction. The write operation is 
+performed before the read. Holding registers are addressed starting at 
+zero.
+
+The request specifies the starting address and number of holding 
+registers to be read as well as the starting address, and the number of 
+holding registers. The data to be written is specified in the transmit 
+buffer.
+
+@param u16ReadAddress address of the first holding register (0x0000..0xFFFF)
+@param u16ReadQty quantity of holding registers to read (1..64, limited by the response buffer)
+@param u16WriteAddress address of the first holding register (0x0000..0xFFFF)
+@param u16WriteQty quantity of holding registers to write (1..64, limited by the transmit buffer; at most 119)
+@return 0 on success; exception number on failure
+@ingroup register
+*/
+uint8_t ModbusTCP::readWriteMultipleRegisters(uint16_t u16ReadAddress,
+  uint16_t u16ReadQty, uint16_t u16WriteAddress, uint16_t u16WriteQty)
+{
+  if (!u16ReadQty || u16ReadQty > MaxBufferSize ||
+    !u16WriteQty || u16WriteQty > MaxBufferSize || u16WriteQty > ku8MaxReadWriteQty)
+  {
+    return MBIllegalDataValue;
+  }
+  _u16ReadAddress = u16ReadAddress;
+  _u16ReadQty = u16ReadQty;
+  _u16WriteAddress = u16WriteAddress;
+  _u16WriteQty = u16WriteQty;
+  return ModbusMasterTransaction(MBReadWriteMultipleRegisters);
+}
+
+
+#if MODBUSTCP_FILES
+/**
+Modbus function 0x14 Read File Record.
+
+Reads u16Length consecutive records of a file in requests of up to 
+ModbusTCP::ku8FileChunk records. The next request is sent before a 
+chunk is handed to the sink, so the server works on it while the sink 
+stores the chunk (e.g. to an SD card), and large files need no more RAM 
+than the response buffer.
+
+The sink is called with the number of the first record of the chunk, 
+the records and their count. Chunks arrive in order unless a gateway 
+reorders responses. After the first failed request, no more requests 
+are sent.
+
+@param u16File file number (0x0001..0xFFFF)
+@param u16Record number of the first record (0x0000..0x270F)
+@param u16Length quantity of records to read
+@param sink function called with each chunk; if 0, the last chunk is left in the response buffer
+@return 0 on success; exception number on failure
+@ingroup register
+*/
+uint8_t ModbusTCP::readFileRecord(uint16_t u16File, uint16_t u16Record,
+  uint16_t u16Length, void (*sink)(uint16_t, const uint16_t *, uint8_t))
+{
+  if (!u16Length)
+  {
+    return MBIllegalDataValue;
+  }
+  _u16FileNumber = u16File;
+  return ModbusFileTransfer(MBReadFileRecord, u16Record, u16Length, sink, 0);
+}
+
+
+/**
+Modbus function 0x15 Write File Record.
+
+Writes u16Length consecutive records of a file in requests of up to 
+ModbusTCP::ku8FileChunk records. The source is asked for the records of 
+each chunk just before it is sent, while the server is still working on 
+the previous one. After the first failed request, no more requests are 
+sent; as with split register writes, the chunks before it have been 
+written.
+
+@param u16File file number (0x0001..0xFFFF)
+@param u16Record number of the first record (0x0000..0x270F)
+@param u16Length quantity of records to write
+@param source function called with number of the first record, buffer and count of the records to fill in
+@return 0 on success; exception number on failure
+@ingroup register
+*/
+uint8_t ModbusTCP::writeFileRecord(uint16_t u16File, uint16_t u16Record,
+  uint16_t u16Length, void (*source)(uint16_t, uint16_t *, uint8_t))
+{
+  if (!u16Length || !source)
+  {
+    return MBIllegalDataValue;
+  }
+  _u16FileNumber = u16File;
+  return ModbusFileTransfer(MBWriteFileRecord, u16Record, u16Length, 0, source);
+}
+
+
+/**
+Modbus function 0x18 Read FIFO Queue.
+
+Reads the contents of a first-in-first-out queue of registers (up to 31 
+values) into the response buffer. The server does not remove the values 
+from the queue. A queue longer than the response buffer 
+(MODBUSTCP_BUFFER_SIZE) is rejected.
+
+@param u16FIFOAddress address of the FIFO pointer register (0x0000..0xFFFF)
+@return 0 on success; ModbusTCP::MBInvalidResponseLength if the queue does not fit the response buffer; exception number on failure
+@ingroup register
+*/
+uint8_t ModbusTCP::readFIFOQueue(uint16_t u16FIFOAddress)
+{
+  _u16ReadAddress = u16FIFOAddress;
+  return ModbusMasterTransaction(MBReadFIFOQueue);
+}
+#endif
+
+
+#if MODBUSTCP_JOURNAL
+/**
+Read the holding registers changed since the last call.
+
+Reads the change journal window of the server (see ModbusJournal) with 
+one request; if nothing changed, that is all. Otherwise each range 
+recorded since u16Sequence is read, once even if it was recorded 
+several times, and passed to the sink while its registers are in the 
+response buffer. Ranges larger than the response buffer are passed in 
+parts. u16Sequence is advanced only when all ranges have been read.
+
+Only changes recorded after u16Sequence are reported, so the client 
+must read the whole register set once before the first call; starting 
+with u16Sequence 0 against an empty journal reads nothing.
+
+@param u16JournalAddress address of the first register of the journal window
+@param u8Entries number of journal entries (1..ModbusTCP::ku8MaxJournalEntries)
+@param u16Sequence sequence number seen last; 0 before the first call
+@param sink function called with address and quantity of each range read
+@return 0 on success; ModbusTCP::MBJournalOverrun if changes were lost (re-read everything); exception number on failure
+@ingroup register
+*/
+uint8_t ModbusTCP::readChangedRegisters(uint16_t u16JournalAddress,
+  uint8_t u8Entries, uint16_t *u16Sequence,
+  void (*sink)(uint16_t, uint8_t))
+{
+#if MODBUSTCP_NONBLOCKING
+  bool bNonBlocking = _bNonBlocking;
+  uint8_t u8MBStatus;
+
+  if (refusePending())
+  {
+    return MBTransactionBusy;
+  }
+  // the ranges to read are only known from the window, so this blocks
+  _bNonBlocking = false;
+  u8MBStatus = ModbusJournalRead(u16JournalAddress, u8Entries, u16Sequence,
+    sink);
+  _bNonBlocking = bNonBlocking;
+  return u8MBStatus;
+#else
+  return ModbusJournalRead(u16JournalAddress, u8Entries, u16Sequence, sink);
+#endif
+}
+
+
+/**
+Change journal read engine, see ModbusTCP::readChangedRegisters().
+
+@param u16JournalAddress address of the first register of the journal window
+@param u8Entries number of journal entries
+@param u16Sequence sequence number seen last
+@param sink function called with address and quantity of each range read
+@return 0 on success; ModbusTCP::MBJournalOverrun or exception number on failure
+*/
+uint8_t ModbusTCP::ModbusJournalRead(uint16_t u16JournalAddress,
+  uint8_t u8Entries, uint16_t *u16Sequence,
+  void (*sink)(uint16_t, uint8_t))
+{
+  uint16_t u16Address[ku8MaxJournalEntries];
+  uint16_t u16Qty[ku8MaxJournalEntries];
+  uint16_t u16Newest;
+  uint16_t u16Unseen;
+  uint16_t u16Done;
+  uint16_t *u16Entry;
+  uint8_t u8Ranges = 0;
+  uint8_t u8Part;
+  uint8_t u8MBStatus;
+  uint8_t i, j;
+
+  if (!u8Entries || u8Entries > ku8MaxJournalEntries)
+  {
+    return MBIllegalDataValue;
+  }
+
+  u8MBStatus = readHoldingRegisters(u16JournalAddress,
+    ModbusJournal::windowSize(u8Entries));
+  if (u8MBStatus)
+  {
+    return u8MBStatus;
+  }
+
+  u16Newest = _u16TxRxBuffer[0];
+  u16Unseen = ModbusJournal::distance(*u16Sequence, u16Newest);
+  if (!u16Unseen)
+  {
+    return MBSuccess;
+  }
+  if (u16Unseen > _u16TxRxBuffer[1])
+  {
+    *u16Sequence = u16Newest;
+    return MBJournalOverrun;
+  }
+
+  // collect unseen ranges before the buffer is reused for reading them
+  for (i = 0; i < u8Entries; i++)
+  {
+    u16Entry = &_u16TxRxBuffer[2 + 3 * i];
+    if (!u16Entry[0] ||
+      ModbusJournal::distance(u16Entry[0], u16Newest) >= u16Unseen)
+    {
+      continue;
+    }
+    for (j = 0; j < u8Ranges; j++)
+    {
+      if (u16Address[j] == u16Entry[1] && u16Qty[j] == u16Entry[2])
+      {
+        break;
+      }
+    }
+    if (j == u8Ranges)
+    {
+      u16Address[u8Ranges] = u16Entry[1];
+      u16Qty[u8Ranges++] = u16Entry[2];
+    }
+  }
+
+  for (i = 0; i < u8Ranges; i++)
+  {
+    for (u16Done = 0; u16Done < u16Qty[i]; u16Done += u8Part)
+    {
+      u8Part = (u16Qty[i] - u16Done > MaxBufferSize) ? MaxBufferSize :
+        u16Qty[i] - u16Done;
+      u8MBStatus = readHoldingRegisters(u16Address[i] + u16Done, u8Part);
+      if (u8MBStatus)
+      {
+        return u8MBStatus;
+      }
+      if (sink)
+      {
+        sink(u16Address[i] + u16Done, u8Part);
+      }
+    }
+  }
+
+  *u16Sequence = u16Newest;
+  return MBSuccess;
+}
+#endif
+
+
+#if MODBUSTCP_DIAGNOSTICS
+/**
+Modbus function 0x08 Diagnostics.
+
+This function code provides a series of tests for checking the 
+communication system between client and server. Over TCP only the 
+sub-functions that do not depend on a serial line are meaningful, e.g. 
+0x0000 Return Query Data (loopback).
+
+The data word echoed by the server is placed in the response buffer.
+
+@param u16SubFunction diagnostics sub-function code (0x0000..0xFFFF)
+@param u16Data data field of the request (0x0000..0xFFFF)
+@return 0 on success; exception number on failure
+@ingroup diagnostic
+*/
+uint8_t ModbusTCP::diagnostics(uint16_t u16SubFunction, uint16_t u16Data)
+{
+  _u16WriteAddress = u16SubFunction;
+  _u16WriteQty = u16Data;
+  return ModbusMasterTransaction(MBDiagnostics);
+}
+
+
+/**
+Modbus function 0x11 Report Server ID.
+
+This function code is used to read the description of the type, the 
+current status, and other information specific to a remote device.
+
+The server-specific data is placed in the response buffer, two bytes per 
+word with the first byte in the high order end of the word. The first 
+byte (server ID) and the second byte (run indicator status, by 
+convention) are cached, see ModbusTCP::getServerID() and 
+ModbusTCP::getRunIndicator().
+
+@return 0 on success; exception number on failure
+@ingroup diagnostic
+*/
+uint8_t ModbusTCP::reportServerID()
+{
+  return ModbusMasterTransaction(MBReportServerID);
+}
+
+
+/**
+Modbus function 0x2B / MEI 0x0E Read Device Identification.
+
+This function code allows reading the identification and additional 
+information relative to the physical and functional description of a 
+remote device.
+
+For stream access (ModbusTCP::MBDeviceIdBasic, ModbusTCP::MBDeviceIdRegular,
+ModbusTCP::MBDeviceIdExtended) the objects are read starting at 
+u8ObjectId; when the server splits them over several responses, the 
+following parts are requested until the server reports no more objects, 
+or reports more without advancing the next object id (the objects 
+received so far are kept; the rest is not read). Each object is passed 
+to the sink as it arrives, so no buffer is needed for the whole 
+identification; a part whose object list is malformed is rejected 
+before any of its objects reach the sink. The conformity level reported 
+by the server is cached, see ModbusTCP::getConformityLevel().
+
+@param u8ReadDevIdCode access code (ModbusTCP::MBDeviceIdBasic..ModbusTCP::MBDeviceIdSpecific)
+@param u8ObjectId first object to read (0x00..0xFF)
+@param sink function receiving object id, value and value length of each object; may be 0
+@return 0 on success; ModbusTCP::MBInvalidResponseLength if a part is malformed; exception number on failure
+@ingroup diagnostic
+*/
+uint8_t ModbusTCP::readDeviceIdentification(uint8_t u8ReadDevIdCode,
+  uint8_t u8ObjectId, void (*sink)(uint8_t, const uint8_t *, uint8_t))
+{
+  uint8_t u8MBStatus;
+  uint16_t u16Part;
+
+  _deviceIdSink = sink;
+  _u16ReadQty = u8ReadDevIdCode;
+  _u16ReadAddress = u8ObjectId;
+  do
+  {
+    u16Part = _u16ReadAddress;
+    u8MBStatus = ModbusMasterTransaction(MBEncapsulatedInterface);
+#if MODBUSTCP_NONBLOCKING
+    // objects arrive later, in service(); the request is built from u8ObjectId then
+    if (u8MBStatus == MBTransactionPending || u8MBStatus == MBTransactionBusy)
+    {
+      return u8MBStatus;
+    }
+#endif
+    _u16ReadAddress = _u8DeviceIdNextObject;
+  }
+  // object ids only go up, so this ends after 256 parts at most
+  while (!u8MBStatus && _u8DeviceIdMoreFollows == 0xFF &&
+    _u16ReadAddress > u16Part && u8ReadDevIdCode != MBDeviceIdSpecific);
+  _deviceIdSink = 0;
+
+  return u8MBStatus;
+}
+
+
+/**
+Retrieve cached Read Device Identification conformity level.
+
+@return conformity level (0x01..0x03, 0x81..0x83); 0 if not read yet
+@ingroup diagnostic
+*/
+uint8_t ModbusTCP::getConformityLevel()
+{
+  return _cache->u8ConformityLevel;
+}
+
+
+/**
+Retrieve cached server ID from the last Report Server ID.
+
+@return server ID byte; 0 if not read yet
+@ingroup diagnostic
+*/
+uint8_t ModbusTCP::getServerID()
+{
+  return _cache->u8ServerID;
+}
+
+
+/**
+Retrieve cached run indicator status from the last Report Server ID.
+
+@return 0x00 = OFF, 0xFF = ON; 0 if not read yet
+@ingroup diagnostic
+*/
+uint8_t ModbusTCP::getRunIndicator()
+{
+  return _cache->u8RunIndicator;
+}
+#endif
+
+
+/**
+Check whether the server's support for a function code has been learned.
+
+Support is learned from every transaction with the server: a normal 
+response marks the function code as supported, an illegal function 
+exception marks it as unsupported.
+
+@see ModbusTCP::isFunctionSupported()
+@param u8MBFunction Modbus function code (0x01..0x3F)
+@return true if a transaction with this function code has been evaluated
+@ingroup diagnostic
+*/
+bool ModbusTCP::isFunctionKnown(uint8_t u8MBFunction)
+{
+  if (u8MBFunction > 0x3F)
+  {
+    return false;
+  }
+  return bitRead(_cache->u8FunctionKnown[u8MBFunction >> 3], u8MBFunction & 0x07);
+}
+
+
+/**
+Check whether the server is known to support a function code.
+
+@see ModbusTCP::isFunctionKnown()
+@param u8MBFunction Modbus function code (0x01..0x3F)
+@return true if the server answered this function code without an illegal function exception
+@ingroup diagnostic
+*/
+bool ModbusTCP::isFunctionSupported(uint8_t u8MBFunction)
+{
+  if (u8MBFunction > 0x3F)
+  {
+    return false;
+  }
+  return bitRead(_cache->u8FunctionSupported[u8MBFunction >> 3], u8MBFunction & 0x07);
+}
+
+
+#if MODBUSTCP_REQUEST_LIMITS
+/**
+Retrieve the request size limit learned for a function code.
+
+@see ModbusTCP::setRequestLimit()
+@param u8MBFunction Modbus function code (0x03, 0x04 or 0x10)
+@return largest quantity currently requested in a single transaction; 0 for other function codes
+@ingroup setup
+*/
+uint8_t ModbusTCP::getRequestLimit(uint8_t u8MBFunction)
+{
+  uint8_t u8Index = requestLimitIndex(u8MBFunction);
+
+  if (u8Index >= sizeof(_cache->u8RequestLimit))
+  {
+    return 0;
+  }
+  return _cache->u8RequestLimit[u8Index];
+}
+
+
+/**
+Set the request size limit for a function code.
+
+Read Holding Registers, Read Input Registers and Write Multiple Registers 
+requests larger than the limit are split into several transactions. The 
+limit is learned automatically for reads: when the server rejects a read 
+with ModbusTCP::MBIllegalDataValue or ModbusTCP::MBIllegalDataAddress, 
+the quantity is narrowed down by binary search between the largest 
+quantity that succeeded and the rejected one, and the block is retried. 
+The largest successful quantity is remembered per function code until 
+the server changes. If the search ends with the request still rejected, 
+the rejection was about the addresses rather than the size; requests of 
+that quantity or more are not searched again.
+
+Writes are never retried smaller, since the server may have rejected 
+them for their content. They are split by the limit set here or learned 
+for Read Holding Registers.
+
+Setting a limit pins it and stops the search, e.g. for servers that 
+report any oversized request with ModbusTCP::MBIllegalDataAddress.
+
+@param u8MBFunction Modbus function code (0x03, 0x04 or 0x10)
+@param u8Qty largest quantity the server accepts (1..64)
+@ingroup setup
+*/
+void ModbusTCP::setRequestLimit(uint8_t u8MBFunction, uint8_t u8Qty)
+{
+  uint8_t u8Index = requestLimitIndex(u8MBFunction);
+
+  if (u8Index >= sizeof(_cache->u8RequestLimit) || !u8Qty)
+  {
+    return;
+  }
+  if (u8Qty > MaxBufferSize)
+  {
+    u8Qty = MaxBufferSize;
+  }
+  _cache->u8RequestLimit[u8Index] = u8Qty;
+  _cache->u8RequestGood[u8Index] = u8Qty;
+  _cache->u8RequestRejected[u8Index] = 0xFF;
+}
+#endif
+
+
+/* _____PRIVATE FUNCTIONS____________________________________________________ */
+/**
+Forget everything learned about the server.
+*/
+void ModbusTCP::clearServerCache()
+{
+  uint8_t i;
+
+#if MODBUSTCP_REQUEST_LIMITS
+  for (i = 0; i < sizeof(_cache->u8RequestLimit); i++)
+  {
+    _cache->u8RequestLimit[i] = MaxBufferSize;
+    _cache->u8RequestGood[i] = 0;
+    _cache->u8RequestRejected[i] = 0xFF;
+  }
+#endif
+
+  for (i = 0; i < sizeof(_cache->u8FunctionKnown); i++)
+  {
+    _cache->u8FunctionKnown[i] = 0;
+    _cache->u8FunctionSupported[i] = 0;
+  }
+#if MODBUSTCP_DIAGNOSTICS
+  _cache->u8ConformityLevel = 0;
+  _cache->u8ServerID = 0;
+  _cache->u8RunIndicator = 0;
+  _u8DeviceIdMoreFollows = 0;
+  _u8DeviceIdNextObject = 0;
+#endif
+}
+
+
+
+#if MODBUSTCP_REQUEST_LIMITS
+/**
+Map a function code to its slot in the request limit tables.
+
+@param u8MBFunction Modbus function code
+@return slot index; sizeof(_cache->u8RequestLimit) if the function code is not split
+*/
+uint8_t ModbusTCP::requestLimitIndex(uint8_t u8MBFunction)
+{
+  switch(u8MBFunction)
+  {
+    case MBReadHoldingRegisters:
+      return 0;
+
+    case MBReadInputRegisters:
+      return 1;
+
+    case MBWriteMultipleRegisters:
+      return 2;
+
+    default:
+      return sizeof(_cache->u8RequestLimit);
+  }
+}
+#endif
+
+
+/**
+Modbus transaction split into blocks the server accepts.
+
+Each block is transferred to/from its position in the response/transmit 
+buffer. The block size is the learned limit, or while the limit is still 
+being searched for after a rejection, the midpoint between the largest 
+quantity that succeeded and the smallest one rejected.
+
+@see ModbusTCP::setRequestLimit()
+@param u8MBFunction Modbus function (0x03, 0x04 or 0x10)
+@param u16Address address of the first register
+@param u16Qty quantity of registers (1..64)
+@return 0 on success; exception number on failure
+*/
+uint8_t ModbusTCP::ModbusChunkedTransaction(uint8_t u8MBFunction,
+  uint16_t u16Address, uint16_t u16Qty)
+{
+#if !MODBUSTCP_REQUEST_LIMITS
+  // single transaction; the server's limit is the caller's business
+  if (u8MBFunction == MBWriteMultipleRegisters)
+  {
+    if (u16Qty > MaxBufferSize || u16Qty > ku8MaxWriteQty)
+    {
+      return MBIllegalDataValue;
+    }
+    _u16WriteAddress = u16Address;
+    _u16WriteQty = u16Qty;
+  }
+  else
+  {
+    _u16ReadAddress = u16Address;
+    _u16ReadQty = u16Qty;
+  }
+  return ModbusMasterTransaction(u8MBFunction);
+#else
+  uint8_t u8Index = requestLimitIndex(u8MBFunction);
+  uint8_t u8EntryLimit = _cache->u8RequestLimit[u8Index];
+  uint8_t u8MBStatus = MBSuccess;
+  uint8_t u8Done = 0;
+  uint8_t u8Rejected = 0;              // quantity whose rejection started a search
+  uint8_t u8Qty;
+
+  if (u16Qty > MaxBufferSize ||
+    (u8MBFunction == MBWriteMultipleRegisters && u16Qty > ku8MaxWriteQty))
+  {
+    return MBIllegalDataValue;
+  }
+
+  while (u8Done < u16Qty && !u8MBStatus)
+  {
+    uint8_t u8Limit = _cache->u8RequestLimit[u8Index];
+    uint8_t u8Good = _cache->u8RequestGood[u8Index];
+
+    // full size until the server rejects one, then bisect towards the limit;
+    // writes are never bisected, a rejected write must not be applied in part
+    u8Qty = (u8MBFunction != MBWriteMultipleRegisters &&
+      u8Limit < MaxBufferSize && u8Good < u8Limit) ?
+      ((u8Good + u8Limit + 1) >> 1) : u8Limit;
+    if (u8Qty > u16Qty - u8Done)
+    {
+      u8Qty = u16Qty - u8Done;
+    }
+#if MODBUSTCP_NONBLOCKING
+    // one request per call when non-blocking; no splitting
+    if (_bNonBlocking)
+    {
+      u8Qty = u16Qty;
+    }
+#endif
+
+    _u8BufferOffset = u8Done;
+    if (u8MBFunction == MBWriteMultipleRegisters)
+    {
+      _u16WriteAddress = u16Address + u8Done;
+      _u16WriteQty = u8Qty;
+    }
+    else
+    {
+      _u16ReadAddress = u16Address + u8Done;
+      _u16ReadQty = u8Qty;
+    }
+    u8MBStatus = ModbusMasterTransaction(u8MBFunction);
+
+    if (u8MBStatus == MBSuccess)
+    {
+      if (u8Qty > u8Good)
+      {
+        _cache->u8RequestGood[u8Index] = u8Qty;
+      }
+      u8Done += u8Qty;
+    }
+    else if ((u8MBStatus == MBIllegalDataValue || u8MBStatus == MBIllegalDataAddress) &&
+      u8MBFunction != MBWriteMultipleRegisters && u8Qty > u8Good && u8Qty > 1 &&
+      u8Qty < _cache->u8RequestRejected[u8Index])
+    {
+      // possibly too large for the server; retry the block smaller
+      if (!u8Rejected)
+      {
+        u8Rejected = u8Qty;
+      }
+      _cache->u8RequestLimit[u8Index] = u8Qty - 1;
+      u8MBStatus = MBSuccess;
+    }
+  }
+  _u8BufferOffset = 0;
+
+  if (u8MBStatus)
+  {
+    if (u8Rejected)
+    {
+      // the rejection was not about size after all; do not search again
+      _cache->u8RequestLimit[u8Index] = u8EntryLimit;
+      _cache->u8RequestRejected[u8Index] = u8Rejected;
+    }
+  }
+  else if (u8MBFunction != MBWriteMultipleRegisters)
+  {
+    _u8ResponseBufferLength = u8Done;
+    // a holding register limit applies to writing them as well
+    if (u8MBFunction == MBReadHoldingRegisters &&
+      _cache->u8RequestLimit[u8Index] < _cache->u8RequestLimit[2])
+    {
+      _cache->u8RequestLimit[2] = _cache->u8RequestLimit[u8Index];
+    }
+  }
+
+  return u8MBStatus;
+#endif
+}
+
+
+/**
+Length of the request PDU (function code and data) for a function.
+
+Known before assembly, so that the MBAP header can be written with its 
+final length and the frame built front to back in one pass.
+
+@param u8MBFunction Modbus function (0x01..0xFF)
+@return PDU length in bytes
+*/
+uint8_t ModbusTCP::requestPDULength(uint8_t u8MBFunction)
+{
+  switch(u8MBFunction)
+  {
+    case MBReadCoils:
+    case MBReadDiscreteInputs:
+    case MBReadInputRegisters:
+    case MBReadHoldingRegisters:
+    case MBWriteSingleCoil:
+    case MBWriteSingleRegister:
+    case MBDiagnostics:
+      return 5;
+
+    case MBWriteMultipleCoils:
+      return 6 + ((_u16WriteQty + 7) >> 3);
+
+    case MBWriteMultipleRegisters:
+      return 6 + (lowByte(_u16WriteQty) << 1);
+
+    case MBMaskWriteRegister:
+      return 7;
+
+    case MBReadWriteMultipleRegisters:
+      return 10 + (lowByte(_u16WriteQty) << 1);
+
+    case MBEncapsulatedInterface:
+      return 4;
+
+    case MBReadFileRecord:
+      return 9;
+
+    case MBWriteFileRecord:
+      return 9 + (lowByte(_u16WriteQty) << 1);
+
+    case MBReadFIFOQueue:
+      return 3;
+
+    default:
+      return 1;
+  }
+}
+
+
+/**
+Assemble Modbus Request Application Data Unit in place.
+
+The frame is sized before assembly and written front to back, so it can 
+be handed to the client in a single write.
+
+@param u8MBFunction Modbus function (0x01..0xFF)
+@param u8ModbusADU buffer receiving the ADU
+@return ADU length in bytes
+*/
+uint8_t ModbusTCP::buildRequestADU(uint8_t u8MBFunction, uint8_t *u8ModbusADU)
+{
+  uint8_t u8ModbusADUSize = 0;
+  uint8_t i;
+#if MODBUSTCP_COILS
+  uint8_t u8Qty;
+#endif
+  uint16_t u16Length;
+
+  if (_prepared)
+  {
+    // encoded once; only transaction and unit identifier change
+    memcpy(u8ModbusADU, _prepared->u8ADU, ModbusPreparedRequest::ku8ADUSize);
+    u8ModbusADU[0] = highByte(_u16MBTransactionID);
+    u8ModbusADU[1] = lowByte(_u16MBTransactionID);
+    u8ModbusADU[6] = _u8MBUnitID;
+    return ModbusPreparedRequest::ku8ADUSize;
+  }
+
+  u16Length = requestPDULength(u8MBFunction) + 1;
+  // MBAP header; length counts unit identifier and PDU
+  u8ModbusADU[u8ModbusADUSize++] = highByte(_u16MBTransactionID);
+  u8ModbusADU[u8ModbusADUSize++] = lowByte(_u16MBTransactionID);
+  u8ModbusADU[u8ModbusADUSize++] = highByte(_u16MBProtocolID);
+  u8ModbusADU[u8ModbusADUSize++] = lowByte(_u16MBProtocolID);
+  u8ModbusADU[u8ModbusADUSize++] = highByte(u16Length);
+  u8ModbusADU[u8ModbusADUSize++] = lowByte(u16Length);
+  u8ModbusADU[u8ModbusADUSize++] = _u8MBUnitID;
+  u8ModbusADU[u8ModbusADUSize++] = u8MBFunction;
+
+  switch(u8MBFunction)
+  {
+    case MBReadCoils:
+    case MBReadDiscreteInputs:
+    case MBReadInputRegisters:
+    case MBReadHoldingRegisters:
+    case MBReadWriteMultipleRegisters:
+      u8ModbusADU[u8ModbusADUSize++] = highByte(_u16ReadAddress);
+      u8ModbusADU[u8ModbusADUSize++] = lowByte(_u16ReadAddress);
+      u8ModbusADU[u8ModbusADUSize++] = highByte(_u16ReadQty);
+      u8ModbusADU[u8ModbusADUSize++] = lowByte(_u16ReadQty);
+      break;
+  }
+  
+  switch(u8MBFunction)
+  {
+    case MBDiagnostics:
+    case MBWriteSingleCoil:
+    case MBMaskWriteRegister:
+    case MBWriteMultipleCoils:
+    case MBWriteSingleRegister:
+    case MBWriteMultipleRegisters:
+    case MBReadWriteMultipleRegisters:
+      u8ModbusADU[u8ModbusADUSize++] = highByte(_u16WriteAddress);
+      u8ModbusADU[u8ModbusADUSize++] = lowByte(_u16WriteAddress);
+      break;
+  }
+  
+  switch(u8MBFunction)
+  {
+    case MBDiagnostics:
+    case MBWriteSingleCoil:
+      u8ModbusADU[u8ModbusADUSize++] = highByte(_u16WriteQty);
+      u8ModbusADU[u8ModbusADUSize++] = lowByte(_u16WriteQty);
+      break;
+      
+    case MBWriteSingleRegister:
+      u8ModbusADU[u8ModbusADUSize++] = highByte(_u16TxRxBuffer[0]);
+      u8ModbusADU[u8ModbusADUSize++] = lowByte(_u16TxRxBuffer[0]);
+      break;
+      
+#if MODBUSTCP_COILS
+    case MBWriteMultipleCoils:
+      u8ModbusADU[u8ModbusADUSize++] = highByte(_u16WriteQty);
+      u8ModbusADU[u8ModbusADUSize++] = lowByte(_u16WriteQty);
+      u8Qty = (_u16WriteQty % 8) ? ((_u16WriteQty >> 3) + 1) : (_u16WriteQty >> 3);
+      u8ModbusADU[u8ModbusADUSize++] = u8Qty;
+      for (i = 0; i < u8Qty; i++)
+      {
+        switch(i % 2)
+        {
+          case 0: // i is even
+            u8ModbusADU[u8ModbusADUSize++] = lowByte(_u16TxRxBuffer[i >> 1]);
+            break;
+            
+          case 1: // i is odd
+            u8ModbusADU[u8ModbusADUSize++] = highByte(_u16TxRxBuffer[i >> 1]);
+            break;
+        }
+      }
+      break;
+#endif
+      
+    case MBWriteMultipleRegisters:
+    case MBReadWriteMultipleRegisters:
+      u8ModbusADU[u8ModbusADUSize++] = highByte(_u16WriteQty);
+      u8ModbusADU[u8ModbusADUSize++] = lowByte(_u16WriteQty);
+      u8ModbusADU[u8ModbusADUSize++] = lowByte(_u16WriteQty << 1);
+      
+      for (i = 0; i < lowByte(_u16WriteQty); i++)
+      {
+        u8ModbusADU[u8ModbusADUSize++] = highByte(_u16TxRxBuffer[_u8BufferOffset + i]);
+        u8ModbusADU[u8ModbusADUSize++] = lowByte(_u16TxRxBuffer[_u8BufferOffset + i]);
+      }
+      break;
+      
+    case MBMaskWriteRegister:
+      u8ModbusADU[u8ModbusADUSize++] = highByte(_u16TxRxBuffer[0]);
+      u8ModbusADU[u8ModbusADUSize++] = lowByte(_u16TxRxBuffer[0]);
+      u8ModbusADU[u8ModbusADUSize++] = highByte(_u16TxRxBuffer[1]);
+      u8ModbusADU[u8ModbusADUSize++] = lowByte(_u16TxRxBuffer[1]);
+      break;
+
+#if MODBUSTCP_FILES
+    case MBReadFileRecord:
+      // a single sub-request
+      u8ModbusADU[u8ModbusADUSize++] = 7;
+      u8ModbusADU[u8ModbusADUSize++] = MBFileReferenceType;
+      u8ModbusADU[u8ModbusADUSize++] = highByte(_u16FileNumber);
+      u8ModbusADU[u8ModbusADUSize++] = lowByte(_u16FileNumber);
+      u8ModbusADU[u8ModbusADUSize++] = highByte(_u16ReadAddress);
+      u8ModbusADU[u8ModbusADUSize++] = lowByte(_u16ReadAddress);
+      u8ModbusADU[u8ModbusADUSize++] = highByte(_u16ReadQty);
+      u8ModbusADU[u8ModbusADUSize++] = lowByte(_u16ReadQty);
+      break;
+
+    case MBWriteFileRecord:
+      // a single sub-request, records from the transmit buffer
+      u8ModbusADU[u8ModbusADUSize++] = 7 + (lowByte(_u16WriteQty) << 1);
+      u8ModbusADU[u8ModbusADUSize++] = MBFileReferenceType;
+      u8ModbusADU[u8ModbusADUSize++] = highByte(_u16FileNumber);
+      u8ModbusADU[u8ModbusADUSize++] = lowByte(_u16FileNumber);
+      u8ModbusADU[u8ModbusADUSize++] = highByte(_u16WriteAddress);
+      u8ModbusADU[u8ModbusADUSize++] = lowByte(_u16WriteAddress);
+      u8ModbusADU[u8ModbusADUSize++] = highByte(_u16WriteQty);
+      u8ModbusADU[u8ModbusADUSize++] = lowByte(_u16WriteQty);
+      for (i = 0; i < lowByte(_u16WriteQty); i++)
+      {
+        u8ModbusADU[u8ModbusADUSize++] = highByte(_u16TxRxBuffer[_u8BufferOffset + i]);
+        u8ModbusADU[u8ModbusADUSize++] = lowByte(_u16TxRxBuffer[_u8BufferOffset + i]);
+      }
+      break;
+
+    case MBReadFIFOQueue:
+      u8ModbusADU[u8ModbusADUSize++] = highByte(_u16ReadAddress);
+      u8ModbusADU[u8ModbusADUSize++] = lowByte(_u16ReadAddress);
+      break;
+#endif
+
+#if MODBUSTCP_DIAGNOSTICS
+    case MBEncapsulatedInterface:
+      u8ModbusADU[u8ModbusADUSize++] = MBReadDeviceIdentification;
+      u8ModbusADU[u8ModbusADUSize++] = lowByte(_u16ReadQty);
+      u8ModbusADU[u8ModbusADUSize++] = lowByte(_u16ReadAddress);
+      break;
+#endif
+  }
+
+  return u8ModbusADUSize;
+}
+
+
+#if MODBUSTCP_FAILOVER
+/**
+Keep the backup connection ready and fail back per policy.
+
+While the primary server is active, the backup connection is re-opened 
+at most once per ModbusTCP::ku16MBStandbyRetry. While the backup is 
+active and the policy is ModbusTCP::MBFailbackInterval, the primary is 
+tried once per interval and made active again when it accepts the 
+connection.
+*/
+void ModbusTCP::serviceStandby()
+{
+  uint32_t u32Now = millis();
+
+  if (!_bBackupConfigured)
+  {
+    return;
+  }
+
+  if (_client == &ModbusClient)
+  {
+    if (!ModbusStandbyClient.connected() &&
+      (u32Now - _u32StandbyCheck) >= ku16MBStandbyRetry)
+    {
+      _u32StandbyCheck = u32Now;
+      ModbusStandbyClient.connect(_backupServerIP, _u16ServerPort);
+    }
+  }
+  else if (_u8FailbackPolicy == MBFailbackInterval &&
+    (u32Now - _u32StandbyCheck) >= _u32FailbackInterval)
+  {
+    _u32StandbyCheck = u32Now;
+    if (ModbusClient.connect(serverIP, _u16ServerPort))
+    {
+      MBconnectionFlag = 1;
+      _connectedIP = serverIP;
+      _u16ConnectedPort = _u16ServerPort;
+      _client = &ModbusClient;
+      _framer.reset();
+      MBDebugPrintln(F("Failed back to primary server"));
+    }
+  }
+}
+
+
+/**
+Switch to the other server after the active one failed.
+
+Switching to the backup requires its standby connection to be up; the 
+time from the start of the failed transaction to the switch is recorded. 
+When the backup fails, the primary becomes active again.
+
+@return true if the transaction should be repeated on the new server
+*/
+bool ModbusTCP::failOver()
+{
+  uint32_t u32Elapsed;
+
+  if (!_bBackupConfigured)
+  {
+    return false;
+  }
+
+  if (_client != &ModbusClient)
+  {
+    ModbusStandbyClient.stop();
+    _client = &ModbusClient;
+    _framer.reset();
+    _u32StandbyCheck = millis();
+    MBDebugPrintln(F("Backup server failed, back to primary"));
+    return true;
+  }
+
+  if (!ModbusStandbyClient.connected())
+  {
+    return false;
+  }
+
+  ModbusClient.stop();
+  MBconnectionFlag = 0;
+  _client = &ModbusStandbyClient;
+  _framer.reset();
+  _u32StandbyCheck = millis();
+
+  u32Elapsed = _u32StandbyCheck - _u32TransactionStart;
+  _u32LastFailoverTime = u32Elapsed;
+  if (u32Elapsed > _u32MaxFailoverTime)
+  {
+    _u32MaxFailoverTime = u32Elapsed;
+  }
+  _u16FailoverCount++;
+  MBDebugPrintln(F("Failed over to backup server"));
+  return true;
+}
+#endif
+
+
+/**
+Connect to the active server unless already connected.
+
+@param bSingleAttempt true to give up after one failed attempt, otherwise retry for 3 seconds
+@return 0 on success; ModbusTCP::MBServerConnectionTimeOut on failure
+*/
+uint8_t ModbusTCP::connectServer(bool bSingleAttempt)
+{
+  MBDebugPrintln(F("Check time for connection."));
+  uint32_t MBconnectionTimer = millis();
+  IPAddress ipAddr = serverIP;
+  uint8_t u8Connected = 0;
+
+#if MODBUSTCP_FAILOVER
+  if (_client != &ModbusClient)
+  {
+    ipAddr = _backupServerIP;
+  }
+  else
+  {
+    // with the backup ready, one failed attempt is enough to switch over
+    bSingleAttempt |= _bBackupConfigured && ModbusStandbyClient.connected();
+  }
+#endif
+
+  if (_client == &ModbusClient && ModbusClient.connected() &&
+    (_connectedIP != serverIP || _u16ConnectedPort != _u16ServerPort))
+  {
+    // still open to another server, e.g. the endpoint of the last request
+    disconnectServer();
+  }
+
+#if WIZNET_W5100  
+  if(!_client->connected()) {             // fOR w5100
+#elif ENC28J60
+  if(((_client == &ModbusClient) && !MBconnectionFlag) || !_client->connected()) {  // For ENC28J60
+#elif ESP8266
+  if (!_client->connected()) {            // for esp8266
+#endif
+    MBDebugPrint(F("Trying to connect..."));
+#if ENC28J60
+    // release the socket of a connection closed by the server
+    _client->stop();
+#endif
+    if (_client == &ModbusClient)
+    {
+      MBconnectionFlag = 0;
+    }
+    while(u8Connected != 1)
+    {
+      if((millis() - MBconnectionTimer) > 3000)
+      {
+        _client->stop();
+        return MBServerConnectionTimeOut;
+      }      
+      u8Connected = _client->connect(ipAddr, _u16ServerPort);
+      MBDebugPrint(F("MBconnectionFlag: "));
+      MBDebugPrintln(u8Connected);
+      if (u8Connected != 1 && bSingleAttempt)
+      {
+        _client->stop();
+        return MBServerConnectionTimeOut;
+      }
+      if (!bSingleAttempt)
+      {
+        delay(100);                                                                    // Read client.connect() Further.
+      }
+    }
+    if (_client == &ModbusClient)
+    {
+      MBconnectionFlag = 1;
+      _connectedIP = ipAddr;
+      _u16ConnectedPort = _u16ServerPort;
+    }
+    // a new connection starts a new byte stream
+    _framer.reset();
+    _u32ConnectCount++;
+#if ESP8266
+    // requests are complete frames; don't let Nagle hold them back
+    _client->setNoDelay(true);
+#endif
+    MBDebugPrintln(F("Connected to Server!!"));
+  }
+  else
+    MBDebugPrintln(F("Already Connected to Server!!"));
+
+  return MBSuccess;
+}
+
+
+#if MODBUSTCP_NONBLOCKING
+/**
+Carry out the pending transaction in steps (non-blocking mode).
+
+Does connect, send and receive steps of the transaction started by the 
+last request until it completes, nothing is left to do right now (no 
+response bytes yet), or the time budget is used up. Each step is short; 
+only connecting takes as long as the network hardware needs for one 
+connect() attempt (a few milliseconds on ESP8266 and W5100 when the 
+server answers). With ModbusTCP::setKeepAlive() that step is rare.
+
+The longest call is recorded, see ModbusTCP::getMaxServiceTime().
+
+@param u32BudgetUs time budget of this call [microseconds]
+@return ModbusTCP::MBTransactionPending while in progress; the result of the transaction (once); ModbusTCP::MBTransactionIdle afterwards
+@ingroup setup
+*/
+uint8_t ModbusTCP::service(uint32_t u32BudgetUs)
+{
+#if MODBUSTCP_SHARED_BUFFERS
+  uint8_t *u8ModbusADU = _u8ModbusADU;
+#else
+  uint8_t u8ModbusADU[256];
+#endif
+  uint32_t u32Start = micros();
+  uint32_t u32Elapsed;
+  uint8_t u8ModbusADUSize;
+  uint8_t u8Frame;
+  uint8_t u8MBStatus = MBTransactionPending;
+
+  if (_u8State == ku8StateIdle)
+  {
+    return MBTransactionIdle;
+  }
+
+  while (u8MBStatus == MBTransactionPending &&
+    (micros() - u32Start) < u32BudgetUs)
+  {
+    if (_u8State == ku8StateConnect)
+    {
+      if (connectServer(true))
+      {
+        if ((millis() - _u32PendingStart) > 3000)
+        {
+          u8MBStatus = MBServerConnectionTimeOut;
+        }
+        // try again in the next call
+        break;
+      }
+      _u8State = ku8StateSend;
+    }
+    else if (_u8State == ku8StateSend)
+    {
+      _u16PendingID = _u16MBTransactionID;
+      u8ModbusADUSize = buildRequestADU(_u8PendingFunction, u8ModbusADU);
+      _u16MBTransactionID++;
+#if MODBUSTCP_CAPTURE
+      if (_capture)
+      {
+        _capture->record(ModbusCapture::CaptureRequest, u8ModbusADU, u8ModbusADUSize);
+      }
+#endif
+      _client->write(u8ModbusADU, u8ModbusADUSize);
+      _framer.begin(_u16PendingID);
+      _u32PendingStart = millis();
+      _u8State = ku8StateReceive;
+    }
+    else
+    {
+      // the body is read only once complete; u8ModbusADU does not outlive this call
+      u8Frame = _framer.receive(*_client, u8ModbusADU, true);
+      if (u8Frame == ModbusFramer::FrameComplete &&
+        word(u8ModbusADU[0], u8ModbusADU[1]) == _u16PendingID)
+      {
+        u8ModbusADUSize = _framer.getFrameLength();
+#if MODBUSTCP_CAPTURE
+        if (_capture)
+        {
+          _capture->record(ModbusCapture::CaptureResponse, u8ModbusADU, u8ModbusADUSize);
+        }
+#endif
+        releaseServer(MBSuccess);
+        _u32TransactionCount++;
+        u8MBStatus = evaluateResponse(_u8PendingFunction, u8ModbusADU,
+          u8ModbusADUSize);
+#if MODBUSTCP_DIAGNOSTICS
+        _deviceIdSink = 0;
+#endif
+      }
+      else if (u8Frame == ModbusFramer::FrameTooLong &&
+        word(u8ModbusADU[0], u8ModbusADU[1]) == _u16PendingID)
+      {
+        // more than fits the ADU buffer; the framer has dropped it
+        releaseServer(MBSuccess);
+        _u32TransactionCount++;
+        u8MBStatus = MBInvalidResponseLength;
+      }
+      else if (u8Frame == ModbusFramer::FrameIncomplete)
+      {
+        if ((millis() - _u32PendingStart) > ku16MBResponseTimeout)
+        {
+          releaseServer(MBResponseTimedOut);
+          _u32TransactionCount++;
+          _u16TimeoutCount++;
+          u8MBStatus = MBResponseTimedOut;
+        }
+        // nothing more to do until bytes arrive
+        break;
+      }
+    }
+  }
+
+  if (u8MBStatus != MBTransactionPending)
+  {
+    _u8State = ku8StateIdle;
+    _prepared = 0;
+    if (_homeCache)
+    {
+      endEndpoint(u8MBStatus);
+    }
+  }
+
+  u32Elapsed = micros() - u32Start;
+  if (u32Elapsed > _u32MaxServiceTime)
+  {
+    _u32MaxServiceTime = u32Elapsed;
+  }
+  return u8MBStatus;
+}
+
+
+/**
+Check for a pending non-blocking transaction.
+
+The pending request is only built when service() sends it, from the 
+request parameters. A request function refused because of it has 
+already overwritten them; they are put back as they were when the 
+pending request was started. The transmit buffer is not saved; functions 
+that fill it check before doing so.
+
+@return true if a transaction is pending; the caller returns ModbusTCP::MBTransactionBusy
+*/
+bool ModbusTCP::refusePending()
+{
+  if (_u8State == ku8StateIdle)
+  {
+    return false;
+  }
+  _u16ReadAddress = _u16PendingReadAddress;
+  _u16ReadQty = _u16PendingReadQty;
+  _u16WriteAddress = _u16PendingWriteAddress;
+  _u16WriteQty = _u16PendingWriteQty;
+  _u8BufferOffset = _u8PendingBufferOffset;
+#if MODBUSTCP_FILES
+  _u16FileNumber = _u16PendingFileNumber;
+#endif
+#if MODBUSTCP_DIAGNOSTICS
+  _deviceIdSink = _pendingDeviceIdSink;
+#endif
+  return true;
+}
+#endif
+
+
+/**
+Modbus transaction with server failover.
+
+With a backup server configured, a transaction that fails to connect or 
+times out on the active server is repeated once on the other server.
+
+@see ModbusTCP::setBackupServerIPAddress()
+@param u8MBFunction Modbus function (0x01..0xFF)
+@return 0 on success; exception number on failure
+*/
+uint8_t ModbusTCP::ModbusMasterTransaction(uint8_t u8MBFunction)
+{
+#if MODBUSTCP_NONBLOCKING
+  if (_bNonBlocking)
+  {
+    // started here, carried out by service()
+    if (refusePending())
+    {
+      return MBTransactionBusy;
+    }
+    _u16PendingReadAddress = _u16ReadAddress;
+    _u16PendingReadQty = _u16ReadQty;
+    _u16PendingWriteAddress = _u16WriteAddress;
+    _u16PendingWriteQty = _u16WriteQty;
+    _u8PendingBufferOffset = _u8BufferOffset;
+#if MODBUSTCP_FILES
+    _u16PendingFileNumber = _u16FileNumber;
+#endif
+#if MODBUSTCP_DIAGNOSTICS
+    _pendingDeviceIdSink = _deviceIdSink;
+#endif
+    _u8PendingFunction = u8MBFunction;
+    _u32PendingStart = millis();
+    _u8ResponseBufferLength = 0;
+    _u8State = ku8StateConnect;
+    return MBTransactionPending;
+  }
+#endif
+#if MODBUSTCP_FAILOVER
+  uint8_t u8MBStatus;
+
+  if (_homeCache)
+  {
+    // a request to an endpoint has no backup
+    return ModbusServerTransaction(u8MBFunction);
+  }
+
+  // keep the backup pre-connected, fail back per policy
+  serviceStandby();
+  _u32TransactionStart = millis();
+
+  u8MBStatus = ModbusServerTransaction(u8MBFunction);
+  if ((u8MBStatus == MBServerConnectionTimeOut || u8MBStatus == MBResponseTimedOut) &&
+    failOver())
+  {
+    u8MBStatus = ModbusServerTransaction(u8MBFunction);
+  }
+  return u8MBStatus;
+#else
+  return ModbusServerTransaction(u8MBFunction);
+#endif
+}
+
+
+/**
+Modbus transaction engine.
 Sequence:
   - assemble Modbus Request Application Data Unit (ADU),
     based on particular function called
@@ -471,206 +2403,581 @@ Sequence:
 @param u8MBFunction Modbus function (0x01..0xFF)
 @return 0 on success; exception number on failure
 */
-uint8_t ModbusTCP::ModbusMasterTransaction(uint8_t u8MBFunction)
+uint8_t ModbusTCP::ModbusServerTransaction(uint8_t u8MBFunction)
 {
+#if MODBUSTCP_SHARED_BUFFERS
+  uint8_t *u8ModbusADU = _u8ModbusADU;
+#else
   uint8_t u8ModbusADU[256];
+#endif
   uint8_t u8ModbusADUSize = 0;
-  uint8_t i, u8Qty;
-  uint16_t packetLength;
   uint32_t u32StartTime;
-  uint16_t u16BytesLeft = 6;
+  uint16_t u16TransactionID = _u16MBTransactionID;
+  uint8_t u8Frame;
   uint8_t u8MBStatus = MBSuccess;
   _u8ResponseBufferLength = 0;
   
   // assemble Modbus Request Application Data Unit
-  u8ModbusADU[u8ModbusADUSize++] = highByte(_u16MBTransactionID);
-  u8ModbusADU[u8ModbusADUSize++] = lowByte(_u16MBTransactionID);
-  u8ModbusADU[u8ModbusADUSize++] = highByte(_u16MBProtocolID);
-  u8ModbusADU[u8ModbusADUSize++] = lowByte(_u16MBProtocolID);
-  u8ModbusADUSize += 2;
-  packetLength = u8ModbusADUSize;
-  u8ModbusADU[u8ModbusADUSize++] = _u8MBUnitID;
-  u8ModbusADU[u8ModbusADUSize++] = u8MBFunction;
+  u8ModbusADUSize = buildRequestADU(u8MBFunction, u8ModbusADU);
+  // every request gets its own id, so late responses can be told apart
+  _u16MBTransactionID++;
 
-  switch(u8MBFunction)
+  u8MBStatus = connectServer(false);
+  if (u8MBStatus)
   {
-    case MBReadCoils:
-    case MBReadDiscreteInputs:
-    case MBReadInputRegisters:
-    case MBReadHoldingRegisters:
-    case MBReadWriteMultipleRegisters:
-      u8ModbusADU[u8ModbusADUSize++] = highByte(_u16ReadAddress);
-      u8ModbusADU[u8ModbusADUSize++] = lowByte(_u16ReadAddress);
-      u8ModbusADU[u8ModbusADUSize++] = highByte(_u16ReadQty);
-      u8ModbusADU[u8ModbusADUSize++] = lowByte(_u16ReadQty);
-      break;
+    return u8MBStatus;
   }
-  
-  switch(u8MBFunction)
+
+#if MODBUSTCP_CAPTURE
+  if (_capture)
   {
-    case MBWriteSingleCoil:
-    case MBMaskWriteRegister:
-    case MBWriteMultipleCoils:
-    case MBWriteSingleRegister:
-    case MBWriteMultipleRegisters:
-    case MBReadWriteMultipleRegisters:
-      u8ModbusADU[u8ModbusADUSize++] = highByte(_u16WriteAddress);
-      u8ModbusADU[u8ModbusADUSize++] = lowByte(_u16WriteAddress);
+    _capture->record(ModbusCapture::CaptureRequest, u8ModbusADU, u8ModbusADUSize);
+  }
+#endif
+
+  // whole frame in one write, so it leaves in a single segment
+  _client->write(u8ModbusADU, u8ModbusADUSize);
+  u8ModbusADUSize = 0;
+  _framer.begin(u16TransactionID);
+  // loop until our response is complete, or we run out of time
+  u32StartTime = millis();
+  while (true)
+  {
+    u8Frame = _framer.receive(*_client, u8ModbusADU);
+    if (u8Frame == ModbusFramer::FrameComplete &&
+      word(u8ModbusADU[0], u8ModbusADU[1]) == u16TransactionID)
+    {
+      u8ModbusADUSize = _framer.getFrameLength();
+      u8MBStatus = MBSuccess;
+      break;
+    }
+    if (u8Frame == ModbusFramer::FrameTooLong &&
+      word(u8ModbusADU[0], u8ModbusADU[1]) == u16TransactionID)
+    {
+      // more than fits the ADU buffer; the framer has dropped it
+      u8MBStatus = MBInvalidResponseLength;
+      break;
+    }
+    if (u8Frame == ModbusFramer::FrameComplete)
+    {
+      // not a leftover, yet not ours either; report it if nothing else comes
+      u8MBStatus = MBInvalidTransactionID;
+    }
+    if (u8Frame == ModbusFramer::FrameIncomplete && _idle)
+    {
+      _idle();
+    }
+    if ((millis() - u32StartTime) > ku16MBResponseTimeout)
+    {
+      if (!u8MBStatus)
+      {
+        u8MBStatus = MBResponseTimedOut;
+      }
       break;
+    }
   }
-  
-  switch(u8MBFunction)
+
+#if MODBUSTCP_CAPTURE
+  if (_capture)
+  {
+    _capture->record(ModbusCapture::CaptureResponse |
+      (u8MBStatus ? ModbusCapture::CaptureIncomplete : 0), u8ModbusADU, u8ModbusADUSize);
+  }
+#endif
+  releaseServer(u8MBStatus);
+
+  _u32TransactionCount++;
+  if (u8MBStatus)
+  {
+    _u16TimeoutCount++;
+    return u8MBStatus;
+  }
+
+  return evaluateResponse(u8MBFunction, u8ModbusADU, u8ModbusADUSize);
+}
+
+
+#if MODBUSTCP_FILES
+/**
+File record transfer engine.
+
+Splits the transfer into requests of ModbusTCP::ku8FileChunk records and 
+keeps ModbusTCP::ku8FileDepth of them outstanding on the one connection. 
+A request's chunk is found from its transaction identifier, so responses 
+may arrive in any order.
+
+@param u8MBFunction Modbus function (0x14, 0x15)
+@param u16Record number of the first record
+@param u16Length quantity of records
+@param sink function called with each chunk read (0x14)
+@param source function called to fill in each chunk to write (0x15)
+@return 0 if all requests succeeded; otherwise result of the first failed one
+*/
+uint8_t ModbusTCP::ModbusFileTransfer(uint8_t u8MBFunction, uint16_t u16Record,
+  uint16_t u16Length, void (*sink)(uint16_t, const uint16_t *, uint8_t),
+  void (*source)(uint16_t, uint16_t *, uint8_t))
+{
+#if MODBUSTCP_SHARED_BUFFERS
+  uint8_t *u8ModbusADU = _u8ModbusADU;
+#else
+  uint8_t u8ModbusADU[256];
+#endif
+  uint16_t u16Chunks = (u16Length + ku8FileChunk - 1) / ku8FileChunk;
+  uint16_t u16FirstID = _u16MBTransactionID;
+  uint16_t u16Next = 0;                // next chunk to send
+  uint16_t u16Base = 0;                // oldest chunk without response
+  uint16_t u16Index;
+  uint8_t u8Done = 0;                  // bit per outstanding chunk, from u16Base: response handled
+  uint8_t u8Qty;
+  uint8_t u8Size;
+  uint8_t u8Frame;
+  uint8_t u8Status;
+  uint8_t u8MBStatus;
+  uint8_t u8Result = MBSuccess;
+  uint32_t u32StartTime;
+
+#if MODBUSTCP_NONBLOCKING
+  // the connection and framer belong to the pending transaction
+  if (refusePending())
+  {
+    return MBTransactionBusy;
+  }
+#endif
+  u8MBStatus = connectServer(false);
+  if (u8MBStatus)
+  {
+    return u8MBStatus;
+  }
+
+  _u8BufferOffset = 0;
+  _framer.begin(u16FirstID);
+  u32StartTime = millis();
+  while (u16Base < u16Chunks)
   {
-    case MBWriteSingleCoil:
-      u8ModbusADU[u8ModbusADUSize++] = highByte(_u16WriteQty);
-      u8ModbusADU[u8ModbusADUSize++] = lowByte(_u16WriteQty);
-      break;
-      
-    case MBWriteSingleRegister:
-      u8ModbusADU[u8ModbusADUSize++] = highByte(_u16TxRxBuffer[0]);
-      u8ModbusADU[u8ModbusADUSize++] = lowByte(_u16TxRxBuffer[0]);
-      break;
-      
-    case MBWriteMultipleCoils:
-      u8ModbusADU[u8ModbusADUSize++] = highByte(_u16WriteQty);
-      u8ModbusADU[u8ModbusADUSize++] = lowByte(_u16WriteQty);
-      u8Qty = (_u16WriteQty % 8) ? ((_u16WriteQty >> 3) + 1) : (_u16WriteQty >> 3);
-      u8ModbusADU[u8ModbusADUSize++] = u8Qty;
-      for (i = 0; i < u8Qty; i++)
+    // keep the window full, so the server never waits for us
+    while (u16Next < u16Chunks && u16Next - u16Base < ku8FileDepth)
+    {
+      u8Qty = (u16Next == u16Chunks - 1) ?
+        u16Length - u16Next * ku8FileChunk : ku8FileChunk;
+      if (u8MBFunction == MBWriteFileRecord)
       {
-        switch(i % 2)
+        source(u16Record + u16Next * ku8FileChunk, _u16TxRxBuffer, u8Qty);
+        _u16WriteAddress = u16Record + u16Next * ku8FileChunk;
+        _u16WriteQty = u8Qty;
+      }
+      else
+      {
+        _u16ReadAddress = u16Record + u16Next * ku8FileChunk;
+        _u16ReadQty = u8Qty;
+      }
+      u8Size = buildRequestADU(u8MBFunction, u8ModbusADU);
+#if MODBUSTCP_CAPTURE
+      if (_capture)
+      {
+        _capture->record(ModbusCapture::CaptureRequest, u8ModbusADU, u8Size);
+      }
+#endif
+      _client->write(u8ModbusADU, u8Size);
+      _framer.expect(_u16MBTransactionID);
+      _u16MBTransactionID++;
+      _u32TransactionCount++;
+      u16Next++;
+    }
+
+    u8Frame = _framer.receive(*_client, u8ModbusADU);
+    u16Index = word(u8ModbusADU[0], u8ModbusADU[1]) - u16FirstID;
+    if ((u8Frame == ModbusFramer::FrameComplete ||
+      u8Frame == ModbusFramer::FrameTooLong) &&
+      u16Index >= u16Base && u16Index < u16Next &&
+      !bitRead(u8Done, u16Index - u16Base))
+    {
+#if MODBUSTCP_CAPTURE
+      if (_capture)
+      {
+        _capture->record(ModbusCapture::CaptureResponse, u8ModbusADU,
+          _framer.getFrameLength());
+      }
+#endif
+      u8Qty = (u16Index == u16Chunks - 1) ?
+        u16Length - u16Index * ku8FileChunk : ku8FileChunk;
+      _u8ResponseBufferLength = 0;
+      u8Status = (u8Frame == ModbusFramer::FrameTooLong) ?
+        MBInvalidResponseLength :
+        evaluateResponse(u8MBFunction, u8ModbusADU, _framer.getFrameLength());
+      if (!u8Status && u8MBFunction == MBReadFileRecord &&
+        _u8ResponseBufferLength != u8Qty)
+      {
+        u8Status = MBInvalidResponseLength;
+      }
+
+      if (u8Status)
+      {
+        if (!u8Result)
         {
-          case 0: // i is even
-            u8ModbusADU[u8ModbusADUSize++] = lowByte(_u16TxRxBuffer[i >> 1]);
-            break;
-            
-          case 1: // i is odd
-            u8ModbusADU[u8ModbusADUSize++] = highByte(_u16TxRxBuffer[i >> 1]);
-            break;
+          u8Result = u8Status;
         }
+        // collect what is outstanding, send nothing more
+        u16Chunks = u16Next;
       }
-      break;
-      
-    case MBWriteMultipleRegisters:
-    case MBReadWriteMultipleRegisters:
-      u8ModbusADU[u8ModbusADUSize++] = highByte(_u16WriteQty);
-      u8ModbusADU[u8ModbusADUSize++] = lowByte(_u16WriteQty);
-      u8ModbusADU[u8ModbusADUSize++] = lowByte(_u16WriteQty << 1);
-      
-      for (i = 0; i < lowByte(_u16WriteQty); i++)
+      else if (sink)
       {
-        u8ModbusADU[u8ModbusADUSize++] = highByte(_u16TxRxBuffer[i]);
-        u8ModbusADU[u8ModbusADUSize++] = lowByte(_u16TxRxBuffer[i]);
+        sink(u16Record + u16Index * ku8FileChunk, _u16TxRxBuffer, u8Qty);
       }
-      break;
-      
-    case MBMaskWriteRegister:
-      u8ModbusADU[u8ModbusADUSize++] = highByte(_u16TxRxBuffer[0]);
-      u8ModbusADU[u8ModbusADUSize++] = lowByte(_u16TxRxBuffer[0]);
-      u8ModbusADU[u8ModbusADUSize++] = highByte(_u16TxRxBuffer[1]);
-      u8ModbusADU[u8ModbusADUSize++] = lowByte(_u16TxRxBuffer[1]);
-      break;
-  }
-  
-  u8ModbusADU[u8ModbusADUSize] = 0;
 
-  packetLength = u8ModbusADUSize - packetLength;
-  u8ModbusADU[4] = packetLength << 8;
-  u8ModbusADU[5] = packetLength;
+      bitSet(u8Done, u16Index - u16Base);
+      while (u8Done & 0x01)
+      {
+        u8Done >>= 1;
+        u16Base++;
+      }
+      u32StartTime = millis();
+    }
+    else if (u8Frame == ModbusFramer::FrameIncomplete && _idle)
+    {
+      _idle();
+    }
 
-  Serial.println(F("Check time for connection."));
-  uint32_t MBconnectionTimer = millis();
-#if WIZNET_W5100  
-  if(!ModbusClient.connected()) {         // fOR w5100
-#elif ENC28J60
-  if(!MBconnectionFlag) {                 // For ENC28J60
-#elif ESP8266
-  if (!ModbusClient.connected()) {        // for esp8266
-#endif
-    Serial.print(F("Trying to connect..."));
-    MBconnectionFlag = 0;
-    while(MBconnectionFlag != 1)
+    if ((millis() - u32StartTime) > ku16MBResponseTimeout)
     {
-      if((millis() - MBconnectionTimer) > 3000)
+      _u16TimeoutCount += u16Next - u16Base;
+      if (!u8Result)
       {
-        ModbusClient.stop();
-        return MBServerConnectionTimeOut;
-      }      
-      MBconnectionFlag = ModbusClient.connect(serverIP, 502);
-      Serial.println("MBconnectionFlag: " + String(int(MBconnectionFlag)));  // Add further functionality here.
-      delay(100);                                                                      // Read client.connect() Further.
+        u8Result = MBResponseTimedOut;
+      }
+      u8MBStatus = MBResponseTimedOut;
+      break;
     }
-    Serial.println(F("Connected to Server!!"));
   }
-  else
-    Serial.println(F("Already Connected to Server!!"));
 
-#ifdef ESP8266
-  ModbusClient.write(&u8ModbusADU[0], u8ModbusADUSize);
+  releaseServer(u8MBStatus);
+  return u8Result;
+}
+#endif
+
+
+#if MODBUSTCP_PIPELINING
+/**
+Pipelined transaction engine for several unit identifiers.
+
+Sends the same read request to each unit, keeping up to 
+ModbusTCP::setMaxInFlight() requests outstanding on the one connection. 
+Requests that can be sent together go out in a single write. Responses 
+are matched by transaction identifier in whatever order they arrive, 
+disassembled into the response buffer and passed to the sink.
+
+@param u8MBFunction Modbus function (0x03, 0x04)
+@param u8UnitIDs unit identifiers to address
+@param u8Units number of unit identifiers
+@param sink function called with unit identifier and result of each request
+@return 0 if all requests succeeded; otherwise result of the first failed one
+*/
+uint8_t ModbusTCP::ModbusUnitScan(uint8_t u8MBFunction,
+  const uint8_t *u8UnitIDs, uint8_t u8Units,
+  void (*sink)(uint8_t, uint8_t))
+{
+#if MODBUSTCP_SHARED_BUFFERS
+  uint8_t *u8ModbusADU = _u8ModbusADU;
 #else
-  ModbusClient.write(u8ModbusADU, u8ModbusADUSize);
+  uint8_t u8ModbusADU[256];
 #endif
-  u8ModbusADUSize = 0;
-  // loop until we run out of time or bytes, or an error occurs
+  uint8_t u8Done[32];                  // bit per unit index: response handled
+  uint8_t u8RequestSize = requestPDULength(u8MBFunction) + 7;
+  uint8_t u8UnitID = _u8MBUnitID;
+  uint16_t u16FirstID = _u16MBTransactionID;
+  uint16_t u16Index;
+  uint8_t u8Next = 0;                  // index of the next unit to send to
+  uint8_t u8Oldest = 0;                // index of the oldest unit without response
+  uint8_t u8InFlight = 0;
+  uint8_t u8Size;
+  uint8_t u8Frame;
+  uint8_t u8Status;
+  uint8_t u8MBStatus;
+  uint8_t u8Result = MBSuccess;
+  uint32_t u32StartTime;
+  uint8_t i;
+
+#if MODBUSTCP_NONBLOCKING
+  // the connection and framer belong to the pending transaction
+  if (refusePending())
+  {
+    return MBTransactionBusy;
+  }
+#endif
+  u8MBStatus = connectServer(false);
+  if (u8MBStatus)
+  {
+    return u8MBStatus;
+  }
+
+  memset(u8Done, 0, sizeof(u8Done));
+  _framer.begin(u16FirstID);
   u32StartTime = millis();
-  while (u16BytesLeft && !u8MBStatus)
+  while (u8Next < u8Units || u8InFlight)
   {
-    if (ModbusClient.available())
+    // fill the window; all new requests leave in one write. The framer
+    // accepts ids up to ModbusFramer::ku8TransactionWindow back from the
+    // newest, so a slow unit holds back requests beyond that
+    u8Size = 0;
+    while (u8Next < u8Units && u8InFlight < _u8MaxInFlight &&
+      u8Next - u8Oldest < ModbusFramer::ku8TransactionWindow &&
+      u8Size + u8RequestSize <= 256)
     {
-      u8ModbusADU[u8ModbusADUSize++] = ModbusClient.read();
-      u16BytesLeft--;
+      _u8MBUnitID = u8UnitIDs[u8Next];
+      buildRequestADU(u8MBFunction, u8ModbusADU + u8Size);
+#if MODBUSTCP_CAPTURE
+      if (_capture)
+      {
+        _capture->record(ModbusCapture::CaptureRequest, u8ModbusADU + u8Size,
+          u8RequestSize);
+      }
+#endif
+      u8Size += u8RequestSize;
+      _u16MBTransactionID++;
+      _u32TransactionCount++;
+      u8Next++;
+      u8InFlight++;
     }
-    else
+    if (u8Size)
     {
-      if (_idle)
+      _client->write(u8ModbusADU, u8Size);
+      _framer.expect(_u16MBTransactionID - 1);
+    }
+
+    u8Frame = _framer.receive(*_client, u8ModbusADU);
+    u16Index = word(u8ModbusADU[0], u8ModbusADU[1]) - u16FirstID;
+    if ((u8Frame == ModbusFramer::FrameComplete ||
+      u8Frame == ModbusFramer::FrameTooLong) && u16Index < u8Next &&
+      !bitRead(u8Done[u16Index >> 3], u16Index & 0x07))
+    {
+#if MODBUSTCP_CAPTURE
+      if (_capture)
+      {
+        _capture->record(ModbusCapture::CaptureResponse, u8ModbusADU,
+          _framer.getFrameLength());
+      }
+#endif
+      bitSet(u8Done[u16Index >> 3], u16Index & 0x07);
+      u8InFlight--;
+      while (u8Oldest < u8Next && bitRead(u8Done[u8Oldest >> 3], u8Oldest & 0x07))
+      {
+        u8Oldest++;
+      }
+      _u8MBUnitID = u8UnitIDs[u16Index];
+      _u8ResponseBufferLength = 0;
+      u8Status = (u8Frame == ModbusFramer::FrameTooLong) ?
+        MBInvalidResponseLength :
+        evaluateResponse(u8MBFunction, u8ModbusADU, _framer.getFrameLength());
+      if (u8Status && !u8Result)
       {
-        _idle();
+        u8Result = u8Status;
       }
+      if (sink)
+      {
+        sink(u8UnitIDs[u16Index], u8Status);
+      }
+      u32StartTime = millis();
     }
-    
-    // evaluate Unit ID, function code once enough bytes have been read
-    if (u8ModbusADUSize == 6)
+    else if (u8Frame == ModbusFramer::FrameIncomplete && _idle)
     {
-      uint16_t responseTransactionId = u8ModbusADU[0];
-      responseTransactionId = responseTransactionId << 8;
-      responseTransactionId |= u8ModbusADU[1];
+      _idle();
+    }
 
-      if (responseTransactionId != _u16MBTransactionID)
+    // the gateway has stopped answering; fail whatever is outstanding
+    if ((millis() - u32StartTime) > ku16MBResponseTimeout)
+    {
+      _u8ResponseBufferLength = 0;
+      for (i = 0; i < u8Units; i++)
       {
-        u8MBStatus = MBInvalidTransactionID;
-        break;
+        if (i >= u8Next)
+        {
+          if (sink)
+          {
+            sink(u8UnitIDs[i], MBRequestNotSent);
+          }
+        }
+        else if (!bitRead(u8Done[i >> 3], i & 0x07))
+        {
+          _u16TimeoutCount++;
+          if (sink)
+          {
+            sink(u8UnitIDs[i], MBResponseTimedOut);
+          }
+        }
       }
-
-      if((u8ModbusADU[2] != 0) || (u8ModbusADU[3] != 0))
+      if (!u8Result)
       {
-        u8MBStatus = MBInvalidProtocol;
-        break;
+        u8Result = MBResponseTimedOut;
       }
+      u8MBStatus = MBResponseTimedOut;
+      break;
+    }
+  }
 
+  _u8MBUnitID = u8UnitID;
+  releaseServer(u8MBStatus);
+  return u8Result;
+}
+#endif
 
 
-      u16BytesLeft = u8ModbusADU[4];
-      u16BytesLeft = u16BytesLeft << 8;
-      u16BytesLeft |= u8ModbusADU[5];
-      
+/**
+Direct one request to an endpoint.
 
-      
-    }
-    if ((millis() - u32StartTime) > ku16MBResponseTimeout)
-    {
-      u8MBStatus = MBResponseTimedOut;
-    }
+IP address, port, unit identifier and server cache of the configured 
+server are kept, and restored by ModbusTCP::endEndpoint(). The request 
+always goes to the primary connection; there is no failover for 
+endpoints.
+
+@param endpoint server to address
+@return false if a non-blocking transaction is still pending
+*/
+bool ModbusTCP::beginEndpoint(ModbusEndpoint &endpoint)
+{
+#if MODBUSTCP_NONBLOCKING
+  if (refusePending())
+  {
+    return false;
   }
-#if WIZNET_W5100  
+#endif
+  _homeIP = serverIP;
+  _u16HomePort = _u16ServerPort;
+  _u8HomeUnitID = _u8MBUnitID;
+  _homeCache = _cache;
+#if MODBUSTCP_FAILOVER
+  _homeClient = _client;
+  if (_client != &ModbusClient)
+  {
+    _client = &ModbusClient;
+    _framer.reset();
+  }
+#endif
+
+  serverIP = endpoint.ip;
+  _u16ServerPort = endpoint.u16Port;
+  _u8MBUnitID = endpoint.u8UnitID;
+  _cache = &endpoint.cache;
+  if (!endpoint.bCacheValid)
+  {
+    clearServerCache();
+    endpoint.bCacheValid = true;
+  }
+  return true;
+}
+
+
+/**
+Return to the configured server after a request to an endpoint.
+
+A kept-alive connection to the endpoint is closed by the next request 
+to another server, see ModbusTCP::connectServer().
+
+@param u8MBStatus result of the request; if pending, ModbusTCP::service() returns later
+@return u8MBStatus
+*/
+uint8_t ModbusTCP::endEndpoint(uint8_t u8MBStatus)
+{
+#if MODBUSTCP_NONBLOCKING
+  // the endpoint stays in effect until service() completes the request
+  if (u8MBStatus == MBTransactionPending)
+  {
+    return u8MBStatus;
+  }
+#endif
+  serverIP = _homeIP;
+  _u16ServerPort = _u16HomePort;
+  _u8MBUnitID = _u8HomeUnitID;
+  _cache = _homeCache;
+  _homeCache = 0;
+#if MODBUSTCP_FAILOVER
+  if (_client != _homeClient)
+  {
+    _client = _homeClient;
+    _framer.reset();
+  }
+#endif
+  return u8MBStatus;
+}
+
+
+/**
+Close the connection to the primary server, e.g. because the server changes.
+*/
+void ModbusTCP::disconnectServer()
+{
   ModbusClient.stop();
-  Serial.println("WIZNET W5100 : Stopping");
+  MBconnectionFlag = 0;
+  if (_client == &ModbusClient)
+  {
+    _framer.reset();
+  }
+}
+
+
+/**
+Close the connection after a transaction, unless it is kept open.
+
+@param u8MBStatus result of the transaction
+*/
+void ModbusTCP::releaseServer(uint8_t u8MBStatus)
+{
+#if !ENC28J60
+  // the result only matters to the ENC28J60 branch
+  (void)u8MBStatus;
+#endif
+#if MODBUSTCP_FAILOVER
+  // the backup connection is kept open as hot standby
+  if (_client == &ModbusClient && !_bKeepAlive)
+#else
+  if (!_bKeepAlive)
+#endif
+  {
+#if WIZNET_W5100  
+    ModbusClient.stop();
+    _framer.reset();
+    MBDebugPrintln(F("WIZNET W5100 : Stopping"));
 #elif ENC28J60
-  Serial.println("ENC28J60 : Not Stopping");
+    // the connection is reused, unless the server stopped answering on it
+    if (u8MBStatus == MBResponseTimedOut)
+    {
+      ModbusClient.stop();
+      MBconnectionFlag = 0;
+      _framer.reset();
+      MBDebugPrintln(F("ENC28J60 : Stopping"));
+    }
+    else
+      MBDebugPrintln(F("ENC28J60 : Not Stopping"));
 #elif ESP8266
-  ModbusClient.stop();
-  Serial.println("ESP8266 : Stopping");
+    ModbusClient.stop();
+    _framer.reset();
+    MBDebugPrintln(F("ESP8266 : Stopping"));
+#endif
+  }
+}
+
+
+/**
+Check a response ADU and disassemble it into the response buffer.
+
+@param u8MBFunction Modbus function of the request
+@param u8ModbusADU response ADU
+@param u8ModbusADUSize response ADU length
+@return 0 on success; exception number on failure
+*/
+uint8_t ModbusTCP::evaluateResponse(uint8_t u8MBFunction,
+  uint8_t *u8ModbusADU, uint8_t u8ModbusADUSize)
+{
+  uint8_t i;
+#if MODBUSTCP_DIAGNOSTICS
+  uint16_t packetLength;
 #endif
+  uint8_t u8MBStatus = MBSuccess;
 
+  // a prepared request knows its response length; an exception response is 9 bytes
+  if (_prepared && u8ModbusADUSize != _prepared->u8ResponseLength &&
+    u8ModbusADUSize != 9)
+  {
+    return MBInvalidResponseLength;
+  }
 
   if(u8ModbusADU[6] != _u8MBUnitID)
   {
@@ -688,12 +2995,30 @@ uint8_t ModbusTCP::ModbusMasterTransaction(uint8_t u8MBFunction)
     u8MBStatus = u8ModbusADU[8];
   }
 
+#if MODBUSTCP_DIAGNOSTICS
+  // only Read Device Identification is implemented on top of function 0x2B
+  if (!u8MBStatus && u8MBFunction == MBEncapsulatedInterface &&
+    u8ModbusADU[8] != MBReadDeviceIdentification)
+  {
+    u8MBStatus = MBInvalidFunction;
+  }
+#endif
+
+  // learn whether the server implements this function code
+  if (u8MBStatus == MBSuccess || u8MBStatus == MBIllegalFunction)
+  {
+    bitSet(_cache->u8FunctionKnown[u8MBFunction >> 3], u8MBFunction & 0x07);
+    bitWrite(_cache->u8FunctionSupported[u8MBFunction >> 3], u8MBFunction & 0x07,
+      u8MBStatus == MBSuccess);
+  }
+
   // disassemble ADU into words
   if (!u8MBStatus)
   {
     // evaluate returned Modbus function code
     switch(u8ModbusADU[7])
     {
+#if MODBUSTCP_COILS
       case MBReadCoils:
       case MBReadDiscreteInputs:
 
@@ -718,6 +3043,7 @@ uint8_t ModbusTCP::ModbusMasterTransaction(uint8_t u8MBFunction)
           _u8ResponseBufferLength = i + 1;
         }
         break;
+#endif
         
       case MBReadInputRegisters:
       case MBReadHoldingRegisters:
@@ -725,13 +3051,110 @@ uint8_t ModbusTCP::ModbusMasterTransaction(uint8_t u8MBFunction)
         // load bytes into word; response bytes are ordered H, L, H, L, ...
         _u8ResponseBufferLength = u8ModbusADU[8] >> 1;
         for (i = 0; i < _u8ResponseBufferLength; i++)
+        {
+          if (_u8BufferOffset + i < MaxBufferSize)
+          {
+            _u16TxRxBuffer[_u8BufferOffset + i] = word(u8ModbusADU[2 * i + 9], u8ModbusADU[2 * i + 10]);
+          }
+        }
+        break;
+
+#if MODBUSTCP_FILES
+      case MBReadFileRecord:
+        // one sub-response: file response length, reference type, records
+        if (u8ModbusADUSize < 11 || u8ModbusADU[9] < 1 ||
+          10 + u8ModbusADU[9] > u8ModbusADUSize ||
+          u8ModbusADU[10] != MBFileReferenceType)
+        {
+          u8MBStatus = MBInvalidResponseLength;
+          break;
+        }
+        _u8ResponseBufferLength = (u8ModbusADU[9] - 1) >> 1;
+        for (i = 0; i < _u8ResponseBufferLength; i++)
+        {
+          if (i < MaxBufferSize)
+          {
+            _u16TxRxBuffer[i] = word(u8ModbusADU[2 * i + 11], u8ModbusADU[2 * i + 12]);
+          }
+        }
+        break;
+
+      case MBReadFIFOQueue:
+        // byte count, FIFO count (0..31), values; a queue that does not fit
+        // the response buffer is rejected rather than cut short
+        if (u8ModbusADUSize < 12 || u8ModbusADU[10] != 0 ||
+          12 + 2 * u8ModbusADU[11] > u8ModbusADUSize ||
+          u8ModbusADU[11] > MaxBufferSize)
+        {
+          u8MBStatus = MBInvalidResponseLength;
+          break;
+        }
+        _u8ResponseBufferLength = u8ModbusADU[11];
+        for (i = 0; i < _u8ResponseBufferLength; i++)
+        {
+          _u16TxRxBuffer[i] = word(u8ModbusADU[2 * i + 12], u8ModbusADU[2 * i + 13]);
+        }
+        break;
+#endif
+
+#if MODBUSTCP_DIAGNOSTICS
+      case MBDiagnostics:
+        // sub-function is echoed, followed by the data word
+        _u16TxRxBuffer[0] = word(u8ModbusADU[10], u8ModbusADU[11]);
+        _u8ResponseBufferLength = 1;
+        break;
+
+      case MBReportServerID:
+        // load bytes into word; response bytes are ordered H, L, H, L, ...
+        _u8ResponseBufferLength = (u8ModbusADU[8] + 1) >> 1;
+        for (i = 0; i < _u8ResponseBufferLength; i++)
         {
           if (i < MaxBufferSize)
           {
-            _u16TxRxBuffer[i] = word(u8ModbusADU[2 * i + 9], u8ModbusADU[2 * i + 10]);
+            _u16TxRxBuffer[i] = word(u8ModbusADU[2 * i + 9],
+              (2 * i + 1 < u8ModbusADU[8]) ? u8ModbusADU[2 * i + 10] : 0);
+          }
+        }
+        _cache->u8ServerID = (u8ModbusADU[8] > 0) ? u8ModbusADU[9] : 0;
+        _cache->u8RunIndicator = (u8ModbusADU[8] > 1) ? u8ModbusADU[10] : 0;
+        break;
+
+      case MBEncapsulatedInterface:
+        // MEI type, access code, conformity level, more follows, next object id, number of objects
+        if (u8ModbusADUSize < 14)
+        {
+          u8MBStatus = MBInvalidResponseLength;
+          break;
+        }
+
+        // objects are listed as id, length, value; check the whole list
+        // before the sink gets any of them
+        packetLength = 14;
+        for (i = 0; i < u8ModbusADU[13] && packetLength + 2 <= u8ModbusADUSize; i++)
+        {
+          packetLength += 2 + u8ModbusADU[packetLength + 1];
+        }
+        if (i < u8ModbusADU[13] || packetLength > u8ModbusADUSize)
+        {
+          u8MBStatus = MBInvalidResponseLength;
+          break;
+        }
+
+        _cache->u8ConformityLevel = u8ModbusADU[10];
+        _u8DeviceIdMoreFollows = u8ModbusADU[11];
+        _u8DeviceIdNextObject = u8ModbusADU[12];
+        packetLength = 14;
+        for (i = 0; i < u8ModbusADU[13]; i++)
+        {
+          if (_deviceIdSink)
+          {
+            _deviceIdSink(u8ModbusADU[packetLength], &u8ModbusADU[packetLength + 2],
+              u8ModbusADU[packetLength + 1]);
           }
+          packetLength += 2 + u8ModbusADU[packetLength + 1];
         }
         break;
+#endif
     }
   }
 
@@ -6,6 +6,7 @@ Arduino library for communicating with Modbus server over Ethernet in TCP.
 @defgroup buffer ModbusTCP Buffer Management
 @defgroup discrete Modbus Function Codes for Discrete Coils/Inputs
 @defgroup register Modbus Function Codes for Holding/Input Registers
+@defgroup diagnostic Modbus Function Codes for Diagnostics/Device Identification
 @defgroup constant Modbus Function Codes, Exception Codes
 */
 /**
@@ -44,12 +45,62 @@ Arduino library for communicating with Modbus server over Ethernet in TCP.
 #ifndef Modbus_TCPIP_h
 #define Modbus_TCPIP_h
 
+/* _____CONFIGURATION________________________________________________________ */
+// Settings below can be changed here or passed as build flags (-D...).
+
 #ifndef WIZNET_W5100
 #define WIZNET_W5100  0       /**< define 1 if  WIZNET W5100 IC is used, otherwise 0 */
+#endif
 #ifndef ENC28J60
 #define ENC28J60      0       /**< define 1 if  ENC28J60 IC is used, otherwise 0     */
+#endif
 #ifndef ESP8266
-#define ESP8266       1
+#if WIZNET_W5100 || ENC28J60
+#define ESP8266       0
+#else
+#define ESP8266       1       /**< define 1 if  ESP8266 is used, otherwise 0         */
+#endif
+#endif
+
+#ifndef MODBUSTCP_COILS
+#define MODBUSTCP_COILS           1   /**< define 0 to compile out function codes 0x01, 0x02, 0x05, 0x0F  */
+#endif
+#ifndef MODBUSTCP_DIAGNOSTICS
+#define MODBUSTCP_DIAGNOSTICS     1   /**< define 0 to compile out function codes 0x08, 0x11, 0x2B        */
+#endif
+#ifndef MODBUSTCP_REQUEST_LIMITS
+#define MODBUSTCP_REQUEST_LIMITS  1   /**< define 0 to compile out request size learning and splitting    */
+#endif
+#ifndef MODBUSTCP_FILES
+#define MODBUSTCP_FILES           1   /**< define 0 to compile out function codes 0x14, 0x15, 0x18        */
+#endif
+#ifndef MODBUSTCP_JOURNAL
+#define MODBUSTCP_JOURNAL         1   /**< define 0 to compile out reading changes from a ModbusJournal    */
+#endif
+#ifndef MODBUSTCP_PIPELINING
+#define MODBUSTCP_PIPELINING      1   /**< define 0 to compile out pipelined requests to several units     */
+#endif
+#ifndef MODBUSTCP_NONBLOCKING
+#define MODBUSTCP_NONBLOCKING     1   /**< define 0 to compile out ModbusTCP::service()                    */
+#endif
+#ifndef MODBUSTCP_SHARED_BUFFERS
+#define MODBUSTCP_SHARED_BUFFERS  0   /**< define 1 to share one ADU and one response buffer between all instances */
+#endif
+#ifndef MODBUSTCP_BUFFER_SIZE
+#define MODBUSTCP_BUFFER_SIZE     64  /**< words in the response/transmit buffer (1..121)                 */
+#endif
+#ifndef MODBUSTCP_FAILOVER
+#define MODBUSTCP_FAILOVER        0   /**< define 1 to add a hot standby backup server                    */
+#endif
+#ifndef MODBUSTCP_TLS
+#define MODBUSTCP_TLS             0   /**< define 1 for Modbus/TCP Security (TLS, port 802); ESP8266 only */
+#endif
+#ifndef MODBUSTCP_CAPTURE
+#define MODBUSTCP_CAPTURE         0   /**< define 1 to record traffic with ModbusTCP::setCapture()        */
+#endif
+#ifndef MODBUSTCP_DEBUG
+#define MODBUSTCP_DEBUG           1   /**< define 0 to drop connection progress messages on Serial        */
+#endif
 
 
 /* _____STANDARD INCLUDES____________________________________________________ */
@@ -72,6 +123,18 @@ Arduino library for communicating with Modbus server over Ethernet in TCP.
 
 #if ESP8266
 #include <WiFiClient.h>
+#if MODBUSTCP_TLS
+#include <WiFiClientSecure.h>
+#endif
+#endif
+
+#if MODBUSTCP_TLS && !ESP8266
+#error "MODBUSTCP_TLS requires ESP8266 (BearSSL)"
+#endif
+
+// a write of 121 registers is the largest request that fits the 256 byte ADU buffer
+#if MODBUSTCP_BUFFER_SIZE < 1 || MODBUSTCP_BUFFER_SIZE > 121
+#error "MODBUSTCP_BUFFER_SIZE must be 1..121"
 #endif
 
 
@@ -80,6 +143,145 @@ Arduino library for communicating with Modbus server over Ethernet in TCP.
 // functions to manipulate words
 #include "util/word.h"
 
+// typed tags spanning one or more registers
+#include "util/tag.h"
+
+// splits the response stream into ADUs
+#include "ModbusFramer.h"
+
+// compact history of polled register blocks
+#include "ModbusSampleBuffer.h"
+
+// latest values of polled register blocks, safe to read from interrupts
+#include "ModbusRegisterImage.h"
+
+#if MODBUSTCP_JOURNAL
+#include "ModbusJournal.h"
+#endif
+
+#if MODBUSTCP_CAPTURE
+#include "ModbusCapture.h"
+#endif
+
+
+/* _____TYPE DEFINITIONS_____________________________________________________ */
+#if WIZNET_W5100
+typedef EthernetClient ModbusClientType;
+#elif ENC28J60
+typedef UIPClient ModbusClientType;
+#elif ESP8266 && MODBUSTCP_TLS
+typedef BearSSL::WiFiClientSecure ModbusClientType;
+#elif ESP8266
+typedef WiFiClient ModbusClientType;
+#endif
+
+
+/**
+What the client has learned about a server from its responses.
+
+@ingroup setup
+*/
+struct ModbusServerCache
+{
+  uint8_t u8FunctionKnown[8];          ///< bit per function code 0x00..0x3F: support is known
+  uint8_t u8FunctionSupported[8];      ///< bit per function code 0x00..0x3F: server accepted it
+#if MODBUSTCP_DIAGNOSTICS
+  uint8_t u8ConformityLevel;           ///< Read Device Identification conformity level, 0 if unknown
+  uint8_t u8ServerID;                  ///< first byte of Report Server ID data
+  uint8_t u8RunIndicator;              ///< Report Server ID run indicator status (0x00 OFF, 0xFF ON)
+#endif
+#if MODBUSTCP_REQUEST_LIMITS
+  uint8_t u8RequestLimit[3];           ///< largest quantity not rejected yet, for FC 0x03, 0x04, 0x10
+  uint8_t u8RequestGood[3];            ///< largest quantity that succeeded, for FC 0x03, 0x04, 0x10
+  uint8_t u8RequestRejected[3];        ///< rejected quantity that was not about size; not searched again
+#endif
+};
+
+
+/**
+A server addressed by IP address, port and unit identifier, together
+with what has been learned about it.
+
+One ModbusTCP object, with one set of buffers, can serve any number of
+endpoints: pass the endpoint with a request, e.g.
+ModbusTCP::readHoldingRegisters(ModbusEndpoint &, uint16_t, uint16_t).
+Only that request goes to the endpoint. In non-blocking mode the endpoint
+must stay valid until ModbusTCP::service() returns the result.
+
+@ingroup setup
+*/
+struct ModbusEndpoint
+{
+  IPAddress ip;                        ///< IP address of the server
+  uint16_t u16Port;                    ///< TCP port of the server
+  uint8_t u8UnitID;                    ///< unit identifier
+  bool bCacheValid;                    ///< cache has been initialized
+  ModbusServerCache cache;             ///< learned from responses
+
+  ModbusEndpoint(IPAddress ipAddr, uint16_t u16ServerPort, uint8_t u8Unit)
+  {
+    ip = ipAddr;
+    u16Port = u16ServerPort;
+    u8UnitID = u8Unit;
+    bCacheValid = false;
+  }
+};
+
+
+/**
+A request encoded once, for polls that repeat the same request.
+
+Functions 0x01..0x04 (read) and 0x05, 0x06 (write single value) are
+supported. With constant parameters the frame is built at compile time:
+
+    constexpr ModbusPreparedRequest pollStatus(0x03, 100, 10);
+
+Only transaction and unit identifier are filled in when it is sent, see
+ModbusTCP::execute(). The length of a valid response is known in advance,
+so a response of any other length is rejected before it is evaluated.
+
+@ingroup setup
+*/
+struct ModbusPreparedRequest
+{
+  static const uint8_t ku8ADUSize = 12;          ///< MBAP header, function code, two words
+
+  uint8_t u8ADU[ku8ADUSize];                     ///< encoded request; transaction and unit identifier are filled in on sending
+  uint8_t u8ResponseLength;                      ///< length of the response ADU; 0 if the request is not valid
+
+  /**
+  Encode a request.
+
+  @param u8Function Modbus function (0x01..0x06)
+  @param u16Address address of the first coil/register
+  @param u16Value quantity to read (0x01..0x04), or value to write (0x05, 0x06)
+  */
+  constexpr ModbusPreparedRequest(uint8_t u8Function, uint16_t u16Address,
+    uint16_t u16Value) :
+    u8ADU{ 0, 0, 0, 0, 0, 6, 0, u8Function,
+      (uint8_t)(u16Address >> 8), (uint8_t)u16Address,
+      (uint8_t)(u16Value >> 8), (uint8_t)u16Value },
+    u8ResponseLength(responseLength(u8Function, u16Value))
+  {
+  }
+
+  /**
+  Length of the response ADU to a request.
+
+  @param u8Function Modbus function (0x01..0x06)
+  @param u16Value quantity to read (0x01..0x04), or value to write (0x05, 0x06)
+  @return length in bytes; 0 if the request is not valid or the response does not fit an ADU buffer
+  */
+  static constexpr uint8_t responseLength(uint8_t u8Function, uint16_t u16Value)
+  {
+    return (u8Function == 0x01 || u8Function == 0x02) ?
+        ((u16Value >= 1 && u16Value <= 2000) ? 9 + ((u16Value + 7) >> 3) : 0) :
+      (u8Function == 0x03 || u8Function == 0x04) ?
+        ((u16Value >= 1 && u16Value <= 123) ? 9 + (u16Value << 1) : 0) :
+      (u8Function == 0x05 || u8Function == 0x06) ? 12 : 0;
+  }
+};
+
 
 /* _____CLASS DEFINITIONS____________________________________________________ */
 /**
@@ -91,12 +293,9 @@ class ModbusTCP
 
     IPAddress serverIP;
 
-#if WIZNET_W5100
-    EthernetClient ModbusClient;
-#elif ENC28J60
-    UIPClient ModbusClient;
-#elif ESP8266
-    WiFiClient ModbusClient;
+    ModbusClientType ModbusClient;
+#if MODBUSTCP_FAILOVER
+    ModbusClientType ModbusStandbyClient;
 #endif
 
     char MBconnectionFlag = 0;
@@ -106,7 +305,47 @@ class ModbusTCP
     void setUnitId(uint8_t);
     void setTransactionID(uint16_t);
     void setServerIPAddress(IPAddress);
+    void setServerPort(uint16_t);
+#if MODBUSTCP_FAILOVER
+    void     setBackupServerIPAddress(IPAddress);
+    void     setFailbackPolicy(uint8_t, uint32_t);
+    bool     isOnBackup();
+    uint16_t getFailoverCount();
+    uint32_t getLastFailoverTime();
+    uint32_t getMaxFailoverTime();
+
+    /**
+    Failback policy: stay on the backup server until it fails.
+
+    @ingroup constant
+    */
+    static const uint8_t MBFailbackNever               = 0x00;
+
+    /**
+    Failback policy: try the primary server periodically and return to it
+    as soon as it accepts a connection.
+
+    @ingroup constant
+    */
+    static const uint8_t MBFailbackInterval            = 0x01;
+#endif
     void idle(void (*)());
+    void setKeepAlive(bool);
+#if MODBUSTCP_NONBLOCKING
+    void     setNonBlocking(bool);
+    uint8_t  service(uint32_t);
+    uint32_t getMaxServiceTime();
+#endif
+#if MODBUSTCP_PIPELINING
+    void setMaxInFlight(uint8_t);
+#endif
+    uint32_t getTransactionCount();
+    uint16_t getTimeoutCount();
+    uint32_t getConnectCount();
+    uint16_t getResyncCount();
+#if MODBUSTCP_CAPTURE
+    void setCapture(ModbusCapture *);
+#endif
 
     // Modbus exception codes
     /**
@@ -185,9 +424,10 @@ class ModbusTCP
     static const uint8_t MBSuccess                     = 0x00;
 
     /**
-    ModbusTCP invalid response slave ID exception.
+    ModbusTCP invalid response transaction ID exception.
 
-    The slave ID in the response does not match that of the request.
+    No response with the transaction ID of the request was received within
+    the timeout period, but a response with another one was.
 
     @ingroup constant
     */
@@ -222,6 +462,107 @@ class ModbusTCP
     static const uint8_t MBInvalidUnitID               = 0xE3;
     static const uint8_t MBInvalidProtocol             = 0xE4;
 
+    /**
+    ModbusTCP change journal overrun exception.
+
+    The server's change journal has dropped entries that had not been
+    read yet; re-read all registers covered by the journal.
+
+    @ingroup constant
+    */
+    static const uint8_t MBJournalOverrun              = 0xE5;
+
+    /**
+    ModbusTCP transaction pending.
+
+    In non-blocking mode the request has been accepted; ModbusTCP::service()
+    returns the result.
+
+    @ingroup constant
+    */
+    static const uint8_t MBTransactionPending          = 0xE6;
+
+    /**
+    ModbusTCP no transaction.
+
+    ModbusTCP::service() has nothing to do; the last result has been
+    returned already.
+
+    @ingroup constant
+    */
+    static const uint8_t MBTransactionIdle             = 0xE7;
+
+    /**
+    ModbusTCP transaction busy.
+
+    In non-blocking mode a request was made while the previous one is
+    still pending; it has not been sent.
+
+    @ingroup constant
+    */
+    static const uint8_t MBTransactionBusy             = 0xE8;
+
+    /**
+    ModbusTCP invalid response length exception.
+
+    The response does not have the expected length, e.g. fewer file
+    records than requested, a response to a prepared request of
+    another length, a truncated Read Device Identification object list,
+    or a response longer than the 256 byte ADU buffer; it has not been
+    evaluated.
+
+    @ingroup constant
+    */
+    static const uint8_t MBInvalidResponseLength       = 0xE9;
+
+    /**
+    ModbusTCP request not sent exception.
+
+    A scan of several units was given up because the gateway stopped
+    answering before the request to this unit was sent.
+
+    @ingroup constant
+    */
+    static const uint8_t MBRequestNotSent              = 0xEA;
+
+    // Read Device Identification access codes
+    /**
+    Read Device Identification basic access (stream).
+
+    Mandatory objects VendorName (0x00), ProductCode (0x01) and
+    MajorMinorRevision (0x02).
+
+    @ingroup constant
+    */
+    static const uint8_t MBDeviceIdBasic               = 0x01;
+
+    /**
+    Read Device Identification regular access (stream).
+
+    Basic objects plus optional objects 0x03..0x7F.
+
+    @ingroup constant
+    */
+    static const uint8_t MBDeviceIdRegular             = 0x02;
+
+    /**
+    Read Device Identification extended access (stream).
+
+    Regular objects plus private objects 0x80..0xFF.
+
+    @ingroup constant
+    */
+    static const uint8_t MBDeviceIdExtended            = 0x03;
+
+    /**
+    Read Device Identification individual access.
+
+    A single object, given by its object id.
+
+    @ingroup constant
+    */
+    static const uint8_t MBDeviceIdSpecific            = 0x04;
+
     uint8_t  getResponseBufferLength();
     uint16_t getResponseBuffer(uint8_t);
     void     clearResponseBuffer();
@@ -229,29 +570,98 @@ class ModbusTCP
     void     clearTransmitBuffer();
 
 
+#if MODBUSTCP_COILS
     uint8_t  readCoils(uint16_t, uint16_t);
     uint8_t  readDiscreteInputs(uint16_t, uint16_t);
+    uint8_t  writeSingleCoil(uint16_t, uint8_t);
+    uint8_t  writeMultipleCoils(uint16_t, uint16_t);
+#endif
     uint8_t  readHoldingRegisters(uint16_t, uint16_t);
     uint8_t  readInputRegisters(uint16_t, uint8_t);
-    uint8_t  writeSingleCoil(uint16_t, uint8_t);
     uint8_t  writeSingleRegister(uint16_t, uint16_t);
-    uint8_t  writeMultipleCoils(uint16_t, uint16_t);
     uint8_t  writeMultipleRegisters(uint16_t, uint16_t);
+    uint8_t  readHoldingRegisters(ModbusEndpoint &, uint16_t, uint16_t);
+    uint8_t  readInputRegisters(ModbusEndpoint &, uint16_t, uint8_t);
+    uint8_t  writeSingleRegister(ModbusEndpoint &, uint16_t, uint16_t);
+    uint8_t  writeMultipleRegisters(ModbusEndpoint &, uint16_t, uint16_t);
+    uint8_t  execute(const ModbusPreparedRequest &);
     uint8_t  maskWriteRegister(uint16_t, uint16_t, uint16_t);
     uint8_t  readWriteMultipleRegisters(uint16_t, uint16_t, uint16_t, uint16_t);
+#if MODBUSTCP_PIPELINING
+    uint8_t  readHoldingRegisters(const uint8_t *, uint8_t, uint16_t, uint16_t,
+      void (*)(uint8_t, uint8_t));
+    uint8_t  readInputRegisters(const uint8_t *, uint8_t, uint16_t, uint16_t,
+      void (*)(uint8_t, uint8_t));
+#endif
+#if MODBUSTCP_FILES
+    uint8_t  readFileRecord(uint16_t, uint16_t, uint16_t,
+      void (*)(uint16_t, const uint16_t *, uint8_t));
+    uint8_t  writeFileRecord(uint16_t, uint16_t, uint16_t,
+      void (*)(uint16_t, uint16_t *, uint8_t));
+    uint8_t  readFIFOQueue(uint16_t);
+
+    static const uint8_t ku8FileChunk = (MODBUSTCP_BUFFER_SIZE < 119) ? MODBUSTCP_BUFFER_SIZE : 119; ///< records per file record request
+    static const uint8_t ku8FileDepth = 2;        ///< file record requests outstanding during a transfer
+#endif
+#if MODBUSTCP_JOURNAL
+    uint8_t  readChangedRegisters(uint16_t, uint8_t, uint16_t *,
+      void (*)(uint16_t, uint8_t));
+
+    static const uint8_t ku8MaxJournalEntries = (MODBUSTCP_BUFFER_SIZE - 2) / 3; ///< largest journal window that fits the response buffer
+#endif
+
+#if MODBUSTCP_DIAGNOSTICS
+    uint8_t  diagnostics(uint16_t, uint16_t);
+    uint8_t  reportServerID();
+    uint8_t  readDeviceIdentification(uint8_t, uint8_t,
+      void (*)(uint8_t, const uint8_t *, uint8_t));
+    uint8_t  getConformityLevel();
+    uint8_t  getServerID();
+    uint8_t  getRunIndicator();
+#endif
+    bool     isFunctionKnown(uint8_t);
+    bool     isFunctionSupported(uint8_t);
+
+#if MODBUSTCP_REQUEST_LIMITS
+    uint8_t  getRequestLimit(uint8_t);
+    void     setRequestLimit(uint8_t, uint8_t);
+#endif
 
   private:
 
     uint8_t  _u8MBUnitID;                                        ///< Unit Identifier for individual unit-identification
     uint16_t _u16MBTransactionID                      = 1;       ///< Transaction id for each transaction
     uint16_t _u16MBProtocolID                         = 0;       ///< Constant
-    static const uint8_t MaxBufferSize                = 64;      ///< size of response/transmit buffers
+    static const uint8_t MaxBufferSize                = MODBUSTCP_BUFFER_SIZE; ///< size of response/transmit buffers
+    static const uint8_t ku8MaxWriteQty               = 121;     ///< registers per Write Multiple Registers that fit the ADU buffer
+    static const uint8_t ku8MaxReadWriteQty           = 119;     ///< registers written per Read/Write Multiple Registers that fit the ADU buffer
+    static const uint16_t ku16MaxCoilQty              = 1936;    ///< coils per Write Multiple Coils that fit the ADU buffer
     uint16_t _u16ReadAddress;                                    ///< slave register from which to read
     uint16_t _u16ReadQty;                                        ///< quantity of words to read
+#if MODBUSTCP_SHARED_BUFFERS
+    static uint8_t  _u8ModbusADU[256];                           ///< request/response ADU, shared by all instances
+    static uint16_t _u16TxRxBuffer[MaxBufferSize];               ///< transmit/receive buffer, shared by all instances
+#else
     uint16_t _u16TxRxBuffer[MaxBufferSize];                      ///Both transmit and receive buffer murged to one buffer.
+#endif
     uint16_t _u16WriteAddress;                                   ///< slave register to which to write
     uint16_t _u16WriteQty;                                       ///< quantity of words to write
     uint8_t _u8ResponseBufferLength;
+    uint8_t _u8BufferOffset;                                     ///< buffer index of the block being transferred
+
+    // per-server cache, learned from responses; cleared when the server changes
+    ModbusServerCache _ownCache;                                 ///< cache of the server set with setServerIPAddress()
+    ModbusServerCache *_cache;                                   ///< cache of the active server or endpoint
+    uint16_t _u16ServerPort;                                     ///< TCP port of the server
+#if MODBUSTCP_DIAGNOSTICS
+    uint8_t _u8DeviceIdMoreFollows;                              ///< Read Device Identification "more follows" of last part
+    uint8_t _u8DeviceIdNextObject;                               ///< Read Device Identification next object id of last part
+    void (*_deviceIdSink)(uint8_t, const uint8_t *, uint8_t);   ///< receives objects while reading device identification
+#endif
+    const ModbusPreparedRequest *_prepared;                      ///< request being sent, if prepared
+#if MODBUSTCP_FILES
+    uint16_t _u16FileNumber;                                     ///< file of the file record being transferred
+#endif
 
     // Modbus function codes for bit access
     static const uint8_t MBReadCoils                  = 0x01; ///< Modbus function 0x01 Read Coils
@@ -267,14 +677,143 @@ class ModbusTCP
     static const uint8_t MBMaskWriteRegister          = 0x16; ///< Modbus function 0x16 Mask Write Register
     static const uint8_t MBReadWriteMultipleRegisters = 0x17; ///< Modbus function 0x17 Read Write Multiple Registers
 
+    // Modbus function codes for file record and FIFO access
+    static const uint8_t MBReadFileRecord             = 0x14; ///< Modbus function 0x14 Read File Record
+    static const uint8_t MBWriteFileRecord            = 0x15; ///< Modbus function 0x15 Write File Record
+    static const uint8_t MBReadFIFOQueue              = 0x18; ///< Modbus function 0x18 Read FIFO Queue
+    static const uint8_t MBFileReferenceType          = 0x06; ///< reference type of a file record sub-request
+
+    // Modbus function codes for diagnostics
+    static const uint8_t MBDiagnostics                = 0x08; ///< Modbus function 0x08 Diagnostics
+    static const uint8_t MBReportServerID             = 0x11; ///< Modbus function 0x11 Report Server ID
+    static const uint8_t MBEncapsulatedInterface      = 0x2B; ///< Modbus function 0x2B Encapsulated Interface Transport
+    static const uint8_t MBReadDeviceIdentification   = 0x0E; ///< MEI type 0x0E Read Device Identification
+
 
     static const uint16_t ku16MBResponseTimeout          = 2000; ///< Modbus timeout [milliseconds]
+#if MODBUSTCP_TLS
+    static const uint16_t ku16MBServerPort               = 802;  ///< Modbus/TCP Security port
+#else
+    static const uint16_t ku16MBServerPort               = 502;  ///< Modbus/TCP port
+#endif
+
+    ModbusClientType *_client;                                   ///< connection of the active server
+#if MODBUSTCP_TLS
+    BearSSL::Session _tlsSession;                                ///< TLS session of the primary server, for resumption
+#if MODBUSTCP_FAILOVER
+    BearSSL::Session _tlsStandbySession;                         ///< TLS session of the backup server
+#endif
+#endif
+
+#if MODBUSTCP_FAILOVER
+    static const uint16_t ku16MBStandbyRetry             = 1000; ///< time between standby connection attempts [milliseconds]
+
+    IPAddress _backupServerIP;                                   ///< backup server
+    bool      _bBackupConfigured;                                ///< backup server has been set
+    uint8_t   _u8FailbackPolicy;                                 ///< MBFailbackNever, MBFailbackInterval
+    uint32_t  _u32FailbackInterval;                              ///< time between attempts to fail back [milliseconds]
+    uint32_t  _u32StandbyCheck;                                  ///< last standby connect / failback attempt
+    uint32_t  _u32TransactionStart;                              ///< start of the current transaction
+    uint16_t  _u16FailoverCount;                                 ///< switches to the backup
+    uint32_t  _u32LastFailoverTime;                              ///< duration of the last failover [milliseconds]
+    uint32_t  _u32MaxFailoverTime;                               ///< duration of the slowest failover [milliseconds]
+
+    void serviceStandby();
+    bool failOver();
+#endif
+
+    // request assembly
+    uint8_t requestPDULength(uint8_t u8MBFunction);
+    uint8_t buildRequestADU(uint8_t u8MBFunction, uint8_t *u8ModbusADU);
 
     // master function that conducts Modbus transactions
     uint8_t ModbusMasterTransaction(uint8_t u8MBFunction);
+    uint8_t ModbusServerTransaction(uint8_t u8MBFunction);
+#if MODBUSTCP_FILES
+    uint8_t ModbusFileTransfer(uint8_t u8MBFunction, uint16_t u16Record,
+      uint16_t u16Length, void (*sink)(uint16_t, const uint16_t *, uint8_t),
+      void (*source)(uint16_t, uint16_t *, uint8_t));
+#endif
+#if MODBUSTCP_JOURNAL
+    uint8_t ModbusJournalRead(uint16_t u16JournalAddress, uint8_t u8Entries,
+      uint16_t *u16Sequence, void (*sink)(uint16_t, uint8_t));
+#endif
+#if MODBUSTCP_PIPELINING
+    uint8_t ModbusUnitScan(uint8_t u8MBFunction, const uint8_t *u8UnitIDs,
+      uint8_t u8Units, void (*sink)(uint8_t, uint8_t));
+#endif
+    uint8_t connectServer(bool bSingleAttempt);
+    void    releaseServer(uint8_t u8MBStatus);
+    uint8_t evaluateResponse(uint8_t u8MBFunction, uint8_t *u8ModbusADU,
+      uint8_t u8ModbusADUSize);
+
+    // split register transfers into blocks the server accepts
+    uint8_t ModbusChunkedTransaction(uint8_t u8MBFunction, uint16_t u16Address,
+      uint16_t u16Qty);
+#if MODBUSTCP_REQUEST_LIMITS
+    uint8_t requestLimitIndex(uint8_t u8MBFunction);
+#endif
+
+    // forget everything learned about the server
+    void clearServerCache();
+    void disconnectServer();
+
+    // a single request to an endpoint; the configured server is kept meanwhile
+    bool    beginEndpoint(ModbusEndpoint &endpoint);
+    uint8_t endEndpoint(uint8_t u8MBStatus);
+    IPAddress _homeIP;                                           ///< configured server during an endpoint request
+    uint16_t _u16HomePort;                                       ///< configured port during an endpoint request
+    uint8_t  _u8HomeUnitID;                                      ///< configured unit identifier during an endpoint request
+    ModbusServerCache *_homeCache;                               ///< configured server's cache; 0 unless an endpoint request is in progress
+#if MODBUSTCP_FAILOVER
+    ModbusClientType *_homeClient;                               ///< active connection before an endpoint request
+#endif
+    IPAddress _connectedIP;                                      ///< server the primary connection was opened to
+    uint16_t _u16ConnectedPort;                                  ///< port the primary connection was opened to
 
     // idle callback function; gets called during idle time between TX and RX
     void (*_idle)();
+
+    ModbusFramer _framer;                                        ///< response stream of the active connection
+    bool _bKeepAlive;                                            ///< keep connection open between transactions
+    uint32_t _u32TransactionCount;                               ///< requests sent
+    uint16_t _u16TimeoutCount;                                   ///< requests without matching response
+    uint32_t _u32ConnectCount;                                   ///< connections opened
+#if MODBUSTCP_NONBLOCKING
+    static const uint8_t ku8StateIdle    = 0;                    ///< no transaction
+    static const uint8_t ku8StateConnect = 1;                    ///< connecting
+    static const uint8_t ku8StateSend    = 2;                    ///< connected, request not sent yet
+    static const uint8_t ku8StateReceive = 3;                    ///< waiting for the response
+
+    bool     _bNonBlocking;                                      ///< requests are carried out by service()
+    uint8_t  _u8State;                                           ///< step of the pending transaction
+    uint8_t  _u8PendingFunction;                                 ///< function of the pending transaction
+    uint16_t _u16PendingID;                                      ///< transaction id of the pending request
+    uint32_t _u32PendingStart;                                   ///< start of connecting / waiting [milliseconds]
+    uint32_t _u32MaxServiceTime;                                 ///< longest service() call [microseconds]
+    uint16_t _u16PendingReadAddress;                             ///< read address of the pending request
+    uint16_t _u16PendingReadQty;                                 ///< read quantity of the pending request
+    uint16_t _u16PendingWriteAddress;                            ///< write address of the pending request
+    uint16_t _u16PendingWriteQty;                                ///< write quantity of the pending request
+    uint8_t  _u8PendingBufferOffset;                             ///< buffer index of the pending request
+#if MODBUSTCP_FILES
+    uint16_t _u16PendingFileNumber;                              ///< file of the pending request
+#endif
+#if MODBUSTCP_DIAGNOSTICS
+    void (*_pendingDeviceIdSink)(uint8_t, const uint8_t *, uint8_t); ///< device identification sink of the pending request
+#endif
+
+    // a request refused while another is pending must not alter it
+    bool refusePending();
+#endif
+#if MODBUSTCP_PIPELINING
+    uint8_t _u8MaxInFlight;                                      ///< outstanding requests to several units
+#endif
+
+#if MODBUSTCP_CAPTURE
+    // traffic recorder; gets every request and response ADU
+    ModbusCapture *_capture;
+#endif
 };
 #endif
 
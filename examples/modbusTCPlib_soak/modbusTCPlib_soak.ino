@@ -0,0 +1,157 @@
+/*
+  Long-running soak test: polls a server with a mix of Modbus functions
+  and reports throughput, errors, connections and free memory, so faults
+  that appear only after hours (transaction ID wraparound, heap
+  fragmentation, leaked sockets) show up as trends in the log.
+
+  Disturb the server or the network while it runs (restart the server,
+  pull the cable, add delay) and check that the counters recover.
+
+  ModbusTCP is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  ModbusTCP is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ModbusTCP.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+#define WIZNET_W5100 1
+
+#include <Ethernet.h>
+#include <utility/w5100.h>
+
+IPAddress ModbusDeviceIP(10, 10, 108, 211);  // Put IP Address of PLC here
+IPAddress moduleIPAddress(10, 10, 108, 23);  // Assign Anything other than the PLC IP Address
+
+byte mac[] = { 0xDE, 0xAD, 0xBE, 0xEF, 0xFE, 0xE1 };
+
+
+#include <ModbusTCP.h>
+
+ModbusTCP node(1);                            // Unit Identifier.
+
+const unsigned long reportInterval = 10000;   // [milliseconds]
+unsigned long lastReport;
+unsigned long lastTransactions;
+unsigned long errors;
+int minFreeMemory = 32767;
+
+
+// free SRAM between heap and stack
+int freeMemory()
+{
+  extern char *__brkval;
+  extern char __heap_start;
+  char top;
+
+  return &top - (__brkval ? __brkval : &__heap_start);
+}
+
+
+// W5100 sockets not closed; should stay at 1 with keep-alive and at most
+// 1 without, a count that keeps growing means leaked sockets
+uint8_t openSockets()
+{
+  uint8_t open = 0;
+  uint8_t i;
+
+  for (i = 0; i < MAX_SOCK_NUM; i++)
+  {
+    SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
+    if (W5100.readSnSR(i) != SnSR::CLOSED)
+    {
+      open++;
+    }
+    SPI.endTransaction();
+  }
+  return open;
+}
+
+
+void setup()
+{
+  pinMode(4, OUTPUT);
+  digitalWrite(4, HIGH);                      // To disable slave select for SD card; depricated.
+
+  Serial.begin(115200);
+  delay(1000);
+  Ethernet.begin(mac, moduleIPAddress);
+  node.setServerIPAddress(ModbusDeviceIP);
+  node.setTransactionID(65000);               // wrap around early in the run
+  delay(6000);                                // To provide sufficient time to initialize.
+
+  lastReport = millis();
+}
+
+
+void loop()
+{
+  static uint8_t step;
+  uint8_t result;
+
+  // mixed function codes, one per loop
+  switch (step++ % 4)
+  {
+    case 0:
+      result = node.readHoldingRegisters(0, 32);
+      break;
+
+    case 1:
+      result = node.readInputRegisters(0, 8);
+      break;
+
+    case 2:
+      result = node.writeSingleRegister(10, step);
+      break;
+
+    default:
+      result = node.readCoils(0, 16);
+      break;
+  }
+  if (result != 0)
+  {
+    errors++;
+  }
+
+  if (freeMemory() < minFreeMemory)
+  {
+    minFreeMemory = freeMemory();
+  }
+
+  if (millis() - lastReport >= reportInterval)
+  {
+    unsigned long transactions = node.getTransactionCount();
+
+    Serial.print(F("t="));
+    Serial.print(millis() / 1000);
+    Serial.print(F("s req/s="));
+    Serial.print((transactions - lastTransactions) * 1000UL / (millis() - lastReport));
+    Serial.print(F(" total="));
+    Serial.print(transactions);
+    Serial.print(F(" errors="));
+    Serial.print(errors);
+    Serial.print(F(" timeouts="));
+    Serial.print(node.getTimeoutCount());
+    Serial.print(F(" connects="));
+    Serial.print(node.getConnectCount());
+    Serial.print(F(" connected="));
+    Serial.print(node.ModbusClient.connected());
+    Serial.print(F(" sockets="));
+    Serial.print(openSockets());
+    Serial.print(F(" resync="));
+    Serial.print(node.getResyncCount());
+    Serial.print(F(" free="));
+    Serial.print(freeMemory());
+    Serial.print(F(" minfree="));
+    Serial.println(minFreeMemory);
+
+    lastTransactions = transactions;
+    lastReport = millis();
+  }
+}
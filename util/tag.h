@@ -0,0 +1,470 @@
+/**
+@file
+Typed Tag Decoding/Encoding Across Register Pairs
+
+@defgroup util_tag "util/tag.h": Typed Tag Decoding/Encoding Across Register Pairs
+@code#include "util/tag.h"@endcode
+
+This header file provides a small tag layer on top of the Modbus response
+and transmit buffers. A tag describes where a value lives (register address),
+what it is (16/32/64-bit integer or 32-bit float), how the device orders its
+bytes and words, and an optional scale factor. A block of tags is decoded in
+one pass over a response buffer, and encoded back into a transmit buffer for
+ModbusTCP::writeMultipleRegisters().
+
+The byte/word order is a template parameter of the inner decoders, so each
+combination compiles down to straight-line word shuffling without run-time
+tests inside the loop.
+
+*/
+/*
+
+  tag.h - Typed Tag Decoding/Encoding Across Register Pairs
+
+  This file is part of ModbusTCP.
+
+  ModbusTCP is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  ModbusTCP is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ModbusTCP.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+
+#ifndef _UTIL_TAG_H_
+#define _UTIL_TAG_H_
+
+#include <string.h>
+#include <math.h>
+
+#include "word.h"
+
+
+/** @ingroup util_tag
+    Data type of a tag.
+*/
+enum ModbusTagType
+{
+  TagUInt16  = 0,     ///< unsigned 16-bit integer, 1 register
+  TagInt16   = 1,     ///< signed 16-bit integer, 1 register
+  TagUInt32  = 2,     ///< unsigned 32-bit integer, 2 registers
+  TagInt32   = 3,     ///< signed 32-bit integer, 2 registers
+  TagUInt64  = 4,     ///< unsigned 64-bit integer, 4 registers
+  TagInt64   = 5,     ///< signed 64-bit integer, 4 registers
+  TagFloat32 = 6      ///< IEEE-754 single precision float, 2 registers
+};
+
+
+/** @ingroup util_tag
+    Word order flag: least significant register comes first.
+*/
+static const uint8_t TagWordSwap = 0x01;
+
+/** @ingroup util_tag
+    Byte order flag: bytes within each register are swapped (low byte first).
+*/
+static const uint8_t TagByteSwap = 0x02;
+
+/** @ingroup util_tag
+    Byte/word order of a multi-register value, named after the order in
+    which the bytes A (most significant) .. D (least significant) of a 32-bit
+    value appear on the wire.
+*/
+enum ModbusTagOrder
+{
+  TagABCD = 0,                            ///< big endian (Modbus standard)
+  TagCDAB = TagWordSwap,                  ///< word swapped
+  TagBADC = TagByteSwap,                  ///< byte swapped
+  TagDCBA = TagWordSwap | TagByteSwap     ///< little endian
+};
+
+
+/** @ingroup util_tag
+    Tag descriptor.
+
+    Scaled values are computed as raw value * fScale; use 1.0 for unscaled tags.
+*/
+struct ModbusTag
+{
+  uint16_t u16Address;    ///< address of the first register of the value
+  uint8_t  u8Type;        ///< ModbusTagType
+  uint8_t  u8Order;       ///< ModbusTagOrder
+  float    fScale;        ///< multiplier to engineering units
+};
+
+
+/* raw unsigned container of a given byte size */
+template <uint8_t u8Size> struct TagRaw;
+template <> struct TagRaw<2> { typedef uint16_t type; };
+template <> struct TagRaw<4> { typedef uint32_t type; };
+template <> struct TagRaw<8> { typedef uint64_t type; };
+
+/* make room for the next word; a 16-bit container holds a single word */
+static inline uint16_t tagShiftWord(uint16_t)        { return 0; }
+static inline uint32_t tagShiftWord(uint32_t u32Raw) { return u32Raw << 16; }
+static inline uint64_t tagShiftWord(uint64_t u64Raw) { return u64Raw << 16; }
+
+
+/** @ingroup util_tag
+    Return number of registers occupied by a tag type.
+
+    @param u8Type ModbusTagType
+    @return number of registers (1, 2 or 4)
+*/
+static inline uint8_t tagWords(uint8_t u8Type)
+{
+  switch(u8Type)
+  {
+    case TagUInt32:
+    case TagInt32:
+    case TagFloat32:
+      return 2;
+
+    case TagUInt64:
+    case TagInt64:
+      return 4;
+
+    default:
+      return 1;
+  }
+}
+
+
+/** @ingroup util_tag
+    Decode one value from consecutive response buffer words.
+
+    @param src object providing getResponseBuffer(uint8_t), e.g. ModbusTCP
+    @param u8Index index of the first word in the response buffer
+    @return decoded value of type T
+*/
+template <typename T, uint8_t u8Order, class Source>
+static inline T tagDecode(Source &src, uint8_t u8Index)
+{
+  typedef typename TagRaw<sizeof(T)>::type Raw;
+  const uint8_t u8Words = sizeof(T) >> 1;
+  Raw raw = 0;
+  T value;
+  uint8_t i;
+
+  for (i = 0; i < u8Words; i++)
+  {
+    uint16_t u16Word = src.getResponseBuffer(u8Index +
+      ((u8Order & TagWordSwap) ? (u8Words - 1 - i) : i));
+
+    if (u8Order & TagByteSwap)
+    {
+      u16Word = word(lowByte(u16Word), highByte(u16Word));
+    }
+    raw = tagShiftWord(raw) | u16Word;
+  }
+
+  memcpy(&value, &raw, sizeof(T));
+  return value;
+}
+
+
+/** @ingroup util_tag
+    Encode one value into consecutive transmit buffer words.
+
+    @param sink object providing setTransmitBuffer(uint8_t, uint16_t), e.g. ModbusTCP
+    @param u8Index index of the first word in the transmit buffer
+    @param value value to encode
+    @return 0 on success; exception number on failure
+*/
+template <typename T, uint8_t u8Order, class Sink>
+static inline uint8_t tagEncode(Sink &sink, uint8_t u8Index, T value)
+{
+  typedef typename TagRaw<sizeof(T)>::type Raw;
+  const uint8_t u8Words = sizeof(T) >> 1;
+  Raw raw;
+  uint8_t i, u8Status = 0;
+
+  memcpy(&raw, &value, sizeof(T));
+
+  // words are produced least significant first
+  for (i = 0; i < u8Words && !u8Status; i++)
+  {
+    uint16_t u16Word = (uint16_t) raw;
+
+    if (u8Order & TagByteSwap)
+    {
+      u16Word = word(lowByte(u16Word), highByte(u16Word));
+    }
+    u8Status = sink.setTransmitBuffer(u8Index +
+      ((u8Order & TagWordSwap) ? i : (u8Words - 1 - i)), u16Word);
+    raw = (Raw) (raw >> 8 >> 8);
+  }
+
+  return u8Status;
+}
+
+
+/* select the order specialization at run time */
+template <typename T, class Source>
+static T tagDecodeOrdered(Source &src, uint8_t u8Index, uint8_t u8Order)
+{
+  switch(u8Order & (TagWordSwap | TagByteSwap))
+  {
+    case TagCDAB: return tagDecode<T, TagCDAB>(src, u8Index);
+    case TagBADC: return tagDecode<T, TagBADC>(src, u8Index);
+    case TagDCBA: return tagDecode<T, TagDCBA>(src, u8Index);
+    default:      return tagDecode<T, TagABCD>(src, u8Index);
+  }
+}
+
+template <typename T, class Sink>
+static uint8_t tagEncodeOrdered(Sink &sink, uint8_t u8Index, uint8_t u8Order,
+  T value)
+{
+  switch(u8Order & (TagWordSwap | TagByteSwap))
+  {
+    case TagCDAB: return tagEncode<T, TagCDAB>(sink, u8Index, value);
+    case TagBADC: return tagEncode<T, TagBADC>(sink, u8Index, value);
+    case TagDCBA: return tagEncode<T, TagDCBA>(sink, u8Index, value);
+    default:      return tagEncode<T, TagABCD>(sink, u8Index, value);
+  }
+}
+
+
+/* decode a tag in its own type, then convert the raw value to T */
+template <typename T, class Source>
+static T tagDecodeRaw(Source &src, uint8_t u8Index, const ModbusTag &tag)
+{
+  switch(tag.u8Type)
+  {
+    case TagInt16:   return (T) tagDecodeOrdered<int16_t>(src, u8Index, tag.u8Order);
+    case TagUInt32:  return (T) tagDecodeOrdered<uint32_t>(src, u8Index, tag.u8Order);
+    case TagInt32:   return (T) tagDecodeOrdered<int32_t>(src, u8Index, tag.u8Order);
+    case TagUInt64:  return (T) tagDecodeOrdered<uint64_t>(src, u8Index, tag.u8Order);
+    case TagInt64:   return (T) tagDecodeOrdered<int64_t>(src, u8Index, tag.u8Order);
+    case TagFloat32: return (T) tagDecodeOrdered<float>(src, u8Index, tag.u8Order);
+    default:         return (T) tagDecodeOrdered<uint16_t>(src, u8Index, tag.u8Order);
+  }
+}
+
+
+/** @ingroup util_tag
+    Decode a single tag into a scaled value.
+
+    @param src object providing getResponseBuffer(uint8_t), e.g. ModbusTCP
+    @param u8Index index of the tag's first word in the response buffer
+    @param tag tag descriptor
+    @return raw value * tag.fScale
+*/
+template <class Source>
+static float tagDecodeValue(Source &src, uint8_t u8Index, const ModbusTag &tag)
+{
+  return tagDecodeRaw<float>(src, u8Index, tag) * tag.fScale;
+}
+
+
+/* round half away from zero before truncating to an integer type */
+static inline float tagRound(float fValue)
+{
+  return (fValue < 0) ? (fValue - 0.5f) : (fValue + 0.5f);
+}
+
+
+/* round and clamp to tMin..tMax, so the conversion to T is defined; NAN gives 0 */
+template <typename T>
+static inline T tagRoundClamp(float fValue, T tMin, T tMax)
+{
+  if (isnan(fValue))
+  {
+    return 0;
+  }
+  fValue = tagRound(fValue);
+  if (fValue <= (float) tMin)
+  {
+    return tMin;
+  }
+  if (fValue >= (float) tMax)
+  {
+    return tMax;
+  }
+  return (T) fValue;
+}
+
+
+/** @ingroup util_tag
+    Encode a single scaled value into the transmit buffer.
+
+    Integer types are rounded to the nearest raw value; values outside the
+    range of the type are clamped to its limits.
+
+    @param sink object providing setTransmitBuffer(uint8_t, uint16_t), e.g. ModbusTCP
+    @param u8Index index of the tag's first word in the transmit buffer
+    @param tag tag descriptor
+    @param fValue value in engineering units
+    @return 0 on success; exception number on failure
+*/
+template <class Sink>
+static uint8_t tagEncodeValue(Sink &sink, uint8_t u8Index, const ModbusTag &tag,
+  float fValue)
+{
+  float fRaw = fValue / tag.fScale;
+
+  switch(tag.u8Type)
+  {
+    case TagInt16:
+      return tagEncodeOrdered(sink, u8Index, tag.u8Order,
+        tagRoundClamp<int16_t>(fRaw, -32767 - 1, 32767));
+    case TagUInt32:
+      return tagEncodeOrdered(sink, u8Index, tag.u8Order,
+        tagRoundClamp<uint32_t>(fRaw, 0, 0xFFFFFFFFUL));
+    case TagInt32:
+      return tagEncodeOrdered(sink, u8Index, tag.u8Order,
+        tagRoundClamp<int32_t>(fRaw, -2147483647L - 1, 2147483647L));
+    case TagUInt64:
+      return tagEncodeOrdered(sink, u8Index, tag.u8Order,
+        tagRoundClamp<uint64_t>(fRaw, 0, 0xFFFFFFFFFFFFFFFFULL));
+    case TagInt64:
+      return tagEncodeOrdered(sink, u8Index, tag.u8Order,
+        tagRoundClamp<int64_t>(fRaw, -9223372036854775807LL - 1, 9223372036854775807LL));
+    case TagFloat32:
+      return tagEncodeOrdered(sink, u8Index, tag.u8Order, fRaw);
+    default:
+      return tagEncodeOrdered(sink, u8Index, tag.u8Order,
+        tagRoundClamp<uint16_t>(fRaw, 0, 0xFFFF));
+  }
+}
+
+
+/** @ingroup util_tag
+    Decode a single tag without scaling, in the type of the caller's choice.
+
+    decodeTags() converts every value to float, which holds integers
+    exactly only up to 2^24: a TagUInt32 totalizer of 16777217 comes out as
+    16777216. decodeTag() converts the raw value straight to T, so counters
+    and identifiers stay exact; tag.fScale is not applied.
+
+    @code
+    uint32_t u32Total;
+
+    if (decodeTag(node, 100, tags[1], &u32Total))
+    {
+      // u32Total in units of 0.01
+    }
+    @endcode
+
+    @param src object providing getResponseBuffer(uint8_t) and getResponseBufferLength(), e.g. ModbusTCP
+    @param u16BaseAddress register address of response buffer index 0
+    @param tag tag descriptor
+    @param value receives the raw value, converted to T
+    @return true if the tag lies within the received registers; value is unchanged otherwise
+*/
+template <typename T, class Source>
+static bool decodeTag(Source &src, uint16_t u16BaseAddress,
+  const ModbusTag &tag, T *value)
+{
+  uint16_t u16Index = tag.u16Address - u16BaseAddress;
+
+  if (tag.u16Address < u16BaseAddress ||
+    u16Index + tagWords(tag.u8Type) > src.getResponseBufferLength())
+  {
+    return false;
+  }
+  *value = tagDecodeRaw<T>(src, (uint8_t) u16Index, tag);
+  return true;
+}
+
+
+/** @ingroup util_tag
+    Decode a block of tags from the response buffer in one pass.
+
+    Values are converted to float and scaled; use decodeTag() for integers
+    that need more than 24 bits of precision.
+
+    The response buffer is assumed to hold registers starting at
+    u16BaseAddress, i.e. the address passed to the preceding read. Tags that
+    fall outside the received registers are set to NAN.
+
+    @code
+    const ModbusTag tags[] = {
+      { 100, TagFloat32, TagCDAB, 1.0  },  // flow
+      { 102, TagUInt32,  TagABCD, 0.01 },  // totalizer
+      { 104, TagInt16,   TagABCD, 0.1  }   // temperature
+    };
+    float values[3];
+
+    if (node.readHoldingRegisters(100, 5) == node.MBSuccess)
+    {
+      decodeTags(node, 100, tags, 3, values);
+    }
+    @endcode
+
+    @param src object providing getResponseBuffer(uint8_t) and getResponseBufferLength(), e.g. ModbusTCP
+    @param u16BaseAddress register address of response buffer index 0
+    @param tags array of tag descriptors
+    @param u8Count number of tags
+    @param fValues array receiving u8Count scaled values
+    @return number of tags decoded
+*/
+template <class Source>
+static uint8_t decodeTags(Source &src, uint16_t u16BaseAddress,
+  const ModbusTag *tags, uint8_t u8Count, float *fValues)
+{
+  uint8_t i, u8Decoded = 0;
+  uint16_t u16Length = src.getResponseBufferLength();
+
+  for (i = 0; i < u8Count; i++)
+  {
+    uint16_t u16Index = tags[i].u16Address - u16BaseAddress;
+
+    if (tags[i].u16Address < u16BaseAddress ||
+      u16Index + tagWords(tags[i].u8Type) > u16Length)
+    {
+      fValues[i] = NAN;
+      continue;
+    }
+    fValues[i] = tagDecodeValue(src, (uint8_t) u16Index, tags[i]);
+    u8Decoded++;
+  }
+
+  return u8Decoded;
+}
+
+
+/** @ingroup util_tag
+    Encode a block of tags into the transmit buffer.
+
+    The transmit buffer is filled relative to u16BaseAddress, ready for
+    ModbusTCP::writeMultipleRegisters(u16BaseAddress, quantity).
+
+    @param sink object providing setTransmitBuffer(uint8_t, uint16_t), e.g. ModbusTCP
+    @param u16BaseAddress register address of transmit buffer index 0
+    @param tags array of tag descriptors
+    @param u8Count number of tags
+    @param fValues array of u8Count values in engineering units
+    @return 0 on success; exception number on failure
+*/
+template <class Sink>
+static uint8_t encodeTags(Sink &sink, uint16_t u16BaseAddress,
+  const ModbusTag *tags, uint8_t u8Count, const float *fValues)
+{
+  uint8_t i, u8Status = 0;
+
+  for (i = 0; i < u8Count && !u8Status; i++)
+  {
+    uint16_t u16Index = tags[i].u16Address - u16BaseAddress;
+
+    if (tags[i].u16Address < u16BaseAddress || u16Index > 0xFF)
+    {
+      return 0x02;    // same as ModbusTCP::MBIllegalDataAddress
+    }
+    u8Status = tagEncodeValue(sink, (uint8_t) u16Index, tags[i], fValues[i]);
+  }
+
+  return u8Status;
+}
+
+
+#endif /* _UTIL_TAG_H_ */